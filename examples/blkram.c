@@ -12,228 +12,4045 @@
  * Teardown likewise varies: blk_cleanup_queue() was removed in 5.15,
  * blk_cleanup_disk() was removed in 5.18; modern kernels use
  * del_gendisk() + put_disk().
+ *
+ * Loading with blkram_bio=1 registers a bio-based disk instead, so the
+ * blk-mq request path and the bare ->submit_bio() path can be compared on
+ * the same backing store.
+ *
+ * The module parameters describe the disks created at load time; more can
+ * be created and destroyed at runtime through configfs.
+ *
+ * With a backing file, a disk starts out with the contents of an image that
+ * is streamed in while the disk is already in use, and is written back to it
+ * on demand.
  */
 
+#include <linux/atomic.h>
 #include <linux/blk-mq.h>
+#include <linux/bitops.h>
 #include <linux/blkdev.h>
+#include <linux/configfs.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/errno.h>
+#include <linux/fadvise.h>
+#include <linux/fs.h>
 #include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
 #include <linux/init.h>
+#include <linux/jump_label.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/lz4.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+/* genhd.h was removed in 5.18; its content lives in blkdev.h since 5.17. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+#include <linux/genhd.h>
+#endif
+
+#define BLKRAM_SECTOR_SIZE 512
+/* A request's byte count is an unsigned int, which caps discard size. */
+#define BLKRAM_MAX_DISCARD_SECTORS (UINT_MAX >> SECTOR_SHIFT)
+
+/* Logical blocks larger than a page need the large block size support that
+ * arrived in 6.15, which defines BLK_MAX_BLOCK_SIZE (64 KiB with THP).
+ */
+#ifdef BLK_MAX_BLOCK_SIZE
+#define BLKRAM_MAX_BLOCK_SIZE BLK_MAX_BLOCK_SIZE
+#else
+#define BLKRAM_MAX_BLOCK_SIZE PAGE_SIZE
+#endif
+
+static unsigned int blkram_nr_devices = 1;
+module_param(blkram_nr_devices, uint, 0444);
+MODULE_PARM_DESC(blkram_nr_devices, "Number of disks created at load time");
+
+static unsigned long blkram_mb = 8;
+module_param(blkram_mb, ulong, 0444);
+MODULE_PARM_DESC(blkram_mb, "Size of the RAM disk in MiB");
+
+static unsigned int blkram_block_size = BLKRAM_SECTOR_SIZE;
+module_param(blkram_block_size, uint, 0444);
+MODULE_PARM_DESC(blkram_block_size, "Logical block size in bytes");
+
+static unsigned int blkram_physical_block_size;
+module_param(blkram_physical_block_size, uint, 0444);
+MODULE_PARM_DESC(blkram_physical_block_size,
+                 "Physical block size in bytes (0 = logical block size)");
+
+/* The I/O size limits below are left to the block layer defaults when 0. */
+static unsigned int blkram_max_hw_sectors_kb;
+module_param(blkram_max_hw_sectors_kb, uint, 0444);
+MODULE_PARM_DESC(blkram_max_hw_sectors_kb, "Largest request in KiB");
+
+static unsigned int blkram_max_segments;
+module_param(blkram_max_segments, uint, 0444);
+MODULE_PARM_DESC(blkram_max_segments, "Most segments in one request");
+
+static unsigned int blkram_max_segment_size;
+module_param(blkram_max_segment_size, uint, 0444);
+MODULE_PARM_DESC(blkram_max_segment_size, "Largest segment in bytes");
+
+static unsigned int blkram_hw_queues;
+module_param(blkram_hw_queues, uint, 0444);
+MODULE_PARM_DESC(blkram_hw_queues,
+                 "Number of hardware queues (0 = one per online CPU)");
+
+static unsigned int blkram_queue_depth = 64;
+module_param(blkram_queue_depth, uint, 0444);
+MODULE_PARM_DESC(blkram_queue_depth, "Number of tags per hardware queue");
+
+static bool blkram_bio;
+module_param(blkram_bio, bool, 0444);
+MODULE_PARM_DESC(blkram_bio, "Bypass blk-mq and handle bios in submit_bio");
+
+static unsigned int blkram_poll_queues;
+module_param(blkram_poll_queues, uint, 0444);
+MODULE_PARM_DESC(blkram_poll_queues,
+                 "Extra hardware queues for polled (IOPOLL/HIPRI) I/O");
+
+static bool blkram_async;
+module_param(blkram_async, bool, 0444);
+MODULE_PARM_DESC(blkram_async, "Copy data in per-CPU workers, not queue_rq");
+
+enum blkram_numa_policy {
+    BLKRAM_NUMA_LOCAL, /* node of the CPU doing the first write */
+    BLKRAM_NUMA_INTERLEAVE, /* round-robin over memory nodes by page index */
+    BLKRAM_NUMA_BIND, /* everything on blkram_numa_node */
+};
+
+static unsigned int blkram_numa_policy = BLKRAM_NUMA_LOCAL;
+module_param(blkram_numa_policy, uint, 0444);
+MODULE_PARM_DESC(blkram_numa_policy,
+                 "Backing page placement: 0=local, 1=interleave, 2=bind");
+
+static int blkram_numa_node = NUMA_NO_NODE;
+module_param(blkram_numa_node, int, 0444);
+MODULE_PARM_DESC(blkram_numa_node, "Node used by blkram_numa_policy=2");
+
+static bool blkram_compress;
+module_param(blkram_compress, bool, 0444);
+MODULE_PARM_DESC(blkram_compress, "Keep written pages LZ4-compressed");
+
+/* The LZ4 library is only built when something selects it, for instance
+ * CONFIG_CRYPTO_LZ4 or CONFIG_ZRAM.
+ */
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define BLKRAM_HAVE_LZ4 1
+#else
+#define BLKRAM_HAVE_LZ4 0
+#endif
+
+static unsigned long blkram_cache_mb;
+module_param(blkram_cache_mb, ulong, 0444);
+MODULE_PARM_DESC(blkram_cache_mb,
+                 "Size of the emulated volatile write cache in MiB (0 = none)");
+
+/* Host-managed zoned mode is only offered where zoned limits are set up
+ * through queue_limits features and zone writes are plugged by the block
+ * layer, i.e. 6.11 and later.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0) &&                        \
+    IS_ENABLED(CONFIG_BLK_DEV_ZONED)
+#define BLKRAM_HAVE_ZONED 1
+#else
+#define BLKRAM_HAVE_ZONED 0
+#endif
+
+static unsigned int blkram_zone_size_mb;
+module_param(blkram_zone_size_mb, uint, 0444);
+MODULE_PARM_DESC(blkram_zone_size_mb,
+                 "Zone size in MiB, a power of two (0 = not zoned)");
+
+static unsigned int blkram_zone_nr;
+module_param(blkram_zone_nr, uint, 0444);
+MODULE_PARM_DESC(blkram_zone_nr,
+                 "Number of zones (0 = as many as fit in blkram_mb)");
+
+static unsigned int blkram_zone_nr_conv;
+module_param(blkram_zone_nr_conv, uint, 0444);
+MODULE_PARM_DESC(blkram_zone_nr_conv,
+                 "Number of leading conventional (random write) zones");
+
+static char *blkram_backing_file;
+module_param(blkram_backing_file, charp, 0444);
+MODULE_PARM_DESC(blkram_backing_file,
+                 "Image file loaded at creation and saved on demand "
+                 "(\".N\" is appended with several disks)");
+
+static bool blkram_dax;
+module_param(blkram_dax, bool, 0444);
+MODULE_PARM_DESC(blkram_dax,
+                 "Map the store into user space through /dev/blkramN_dax");
+
+/* The backing file is streamed in chunks of this size. */
+#define BLKRAM_BACKING_CHUNK SZ_1M
+
+/* Set on a page while the shrinker decides whether to replace it. */
+#define BLKRAM_SHRINK_MARK XA_MARK_0
+
+/* Pages that do not shrink below this are kept uncompressed. */
+#define BLKRAM_ZMAX_LEN (PAGE_SIZE * 3 / 4)
+
+/* Latency histograms: log2 buckets of nanoseconds, bucket i counting
+ * [2^i, 2^(i+1)), split by stage, operation and request size.
+ */
+#define BLKRAM_LAT_BUCKETS 32
+
+enum blkram_lat_stage {
+    BLKRAM_LAT_Q2S, /* block layer allocation to ->queue_rq() */
+    BLKRAM_LAT_COPY, /* servicing the request against the page store */
+    BLKRAM_LAT_TOTAL, /* block layer allocation to completion */
+    BLKRAM_LAT_STAGES,
+};
+
+enum blkram_lat_op {
+    BLKRAM_LAT_READ,
+    BLKRAM_LAT_WRITE,
+    BLKRAM_LAT_OTHER, /* discard and write-zeroes */
+    BLKRAM_LAT_OPS,
+};
+
+enum blkram_lat_size {
+    BLKRAM_LAT_4K,
+    BLKRAM_LAT_64K,
+    BLKRAM_LAT_512K,
+    BLKRAM_LAT_LARGER,
+    BLKRAM_LAT_SIZES,
+};
+
+struct blkram_lat {
+    u64 hist[BLKRAM_LAT_STAGES][BLKRAM_LAT_OPS][BLKRAM_LAT_SIZES]
+            [BLKRAM_LAT_BUCKETS];
+};
+
+/* I/O counters, indexed like the latency histograms. */
+struct blkram_stat {
+    u64 ios[BLKRAM_LAT_OPS];
+    u64 bytes[BLKRAM_LAT_OPS];
+    u64 segments[BLKRAM_LAT_OPS];
+    u64 merges[BLKRAM_LAT_OPS]; /* bios merged into an earlier one */
+    u64 errors[BLKRAM_LAT_OPS];
+};
+
+/* How long completions are held back, set through debugfs. */
+enum blkram_delay_mode {
+    BLKRAM_DELAY_NONE,
+    BLKRAM_DELAY_FIXED, /* delay_ns */
+    BLKRAM_DELAY_UNIFORM, /* uniform in [delay_ns, delay_max_ns] */
+    BLKRAM_DELAY_TAIL, /* delay_ns, except tail_ppm in 10^6 take tail_ns */
+};
+
+/* Fault and latency injection, indexed like the latency histograms. */
+struct blkram_inject {
+    u32 delay_mode;
+    u64 delay_ns;
+    u64 delay_max_ns;
+    u64 tail_ns;
+    u32 tail_ppm;
+    u32 error_ppm[BLKRAM_LAT_OPS]; /* failed I/Os per million */
+};
+
+/* A compressed page. Incompressible pages are kept whole in @page. */
+struct blkram_zobj {
+    struct rcu_head rcu;
+    struct page *page;
+    unsigned int len; /* bytes in @data, or PAGE_SIZE with @page */
+    u8 data[];
+};
+
+/* Writers to the same page are serialized by one of these, picked by page
+ * index; each also owns the buffers for a compression.
+ */
+struct blkram_zstripe {
+    struct mutex lock;
+    void *buf; /* the page being written, uncompressed */
+    void *cbuf; /* compressed output */
+    void *wmem; /* LZ4 work memory */
+};
+
+struct blkram_zstat {
+    u64 comp_calls;
+    u64 comp_ns;
+    u64 decomp_calls;
+    u64 decomp_ns;
+};
+
+/* The settings of one disk. A configfs directory owns one for as long as it
+ * exists, and @dev is the disk while it is powered on.
+ */
+struct blkram_config {
+    struct config_group group;
+    unsigned long mb;
+    unsigned int hw_queues;
+    unsigned int queue_depth;
+    unsigned int block_size;
+    unsigned int physical_block_size;
+    unsigned int max_hw_sectors_kb;
+    unsigned int max_segments;
+    unsigned int max_segment_size;
+    bool bio;
+    unsigned int poll_queues;
+    bool async;
+    unsigned int numa_policy;
+    int numa_node;
+    bool compress;
+    unsigned long cache_mb;
+    unsigned int zone_size_mb;
+    unsigned int zone_nr;
+    unsigned int zone_nr_conv;
+    char *backing_file; /* NULL for none */
+    bool dax;
+    struct blkram_dev *dev;
+};
+
+struct blkram_zone {
+    struct mutex lock; /* held while the zone is written or changed */
+    sector_t start;
+    sector_t wp; /* write pointer */
+    enum blk_zone_type type;
+    enum blk_zone_cond cond;
+};
+
+struct blkram_dev {
+    struct kref ref; /* held by the disk and by every open DAX file */
+    int id; /* blkram<id>, and the disk's minor */
+    struct list_head list; /* on blkram_devs */
+    bool bio;
+    unsigned int block_size;
+    struct dentry *debugfs;
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *disk;
+    struct request_queue *queue;
+    /* page index -> struct page, filled on first write. In compressed mode
+     * an entry is a struct blkram_zobj instead. In either mode a value entry
+     * holds the 32-bit pattern of a same-filled page.
+     */
+    struct xarray *pages;
+    /* While a snapshot exists, @snap is the frozen map and @pages only holds
+     * what changed since, with pattern 0 entries hiding discarded pages.
+     */
+    struct xarray *snap;
+    struct xarray maps[2]; /* what @pages and @snap point to */
+    struct mutex snap_lock; /* serializes snapshot operations and saves */
+    u64 size;
+    unsigned int poll_queues;
+    bool async;
+    long __percpu *async_inflight; /* handed to a worker, not yet completed */
+    unsigned int numa_policy;
+    int numa_node; /* home node for BIND, NUMA_NO_NODE otherwise */
+    int nr_mem_nodes;
+    int *mem_nodes; /* nodes with memory, for INTERLEAVE */
+    atomic_long_t *node_pages; /* backing pages per node, nr_node_ids long */
+    struct blkram_lat __percpu *lat;
+    struct blkram_stat __percpu *stat;
+    struct blkram_inject inject;
+    bool compress;
+    unsigned int nr_zstripes; /* a power of two */
+    struct blkram_zstripe *zstripes;
+    void *__percpu *zbuf; /* per-CPU bounce page for partial reads */
+    struct blkram_zstat __percpu *zstat;
+    atomic_long_t z_pages; /* entries in the compressed store */
+    atomic_long_t z_same; /* ... of which same-filled */
+    atomic_long_t z_huge; /* ... of which stored uncompressed */
+    atomic64_t z_bytes; /* memory holding page data */
+    unsigned long cache_limit; /* in pages, 0 without a write cache */
+    struct xarray cache; /* page index -> dirty struct page, not yet flushed */
+    atomic_long_t cache_pages;
+    unsigned int nr_cache_locks; /* a power of two */
+    struct mutex *cache_locks; /* serialize cache updates, by page index */
+    atomic64_t flushes;
+    atomic64_t flush_ns;
+    struct blkram_zone *zones; /* NULL unless zoned */
+    unsigned int nr_zones;
+    sector_t zone_sectors; /* a power of two */
+    char *backing_file; /* NULL without a backing file */
+    struct file *load_file; /* the image being loaded */
+    struct work_struct load_work;
+    wait_queue_head_t load_wq; /* I/O waiting for the loader */
+    unsigned long load_next; /* pages below this index are loaded */
+    bool load_stop;
+    int load_err;
+    struct file *save_file; /* the image being saved */
+    struct work_struct save_work;
+    unsigned long save_next; /* pages written so far */
+    bool saving; /* under snap_lock */
+    bool save_stop;
+    int save_err;
+    bool dax;
+    struct miscdevice dax_misc;
+    char dax_name[DISK_NAME_LEN];
+    bool shrink; /* has a shrinker */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    struct shrinker *shrinker;
+#else
+    struct shrinker shrinker;
+#endif
+    wait_queue_head_t shrink_wq; /* writers waiting for the shrinker */
+    unsigned long shrink_cursor; /* where the next scan starts */
+    atomic64_t shrink_scanned;
+    atomic64_t shrink_reclaimed;
+};
+
+/* Per-hardware-queue state, hung off hctx->driver_data. */
+struct blkram_queue {
+    spinlock_t poll_lock;
+    struct list_head poll_list; /* finished requests waiting for ->poll() */
+};
+
+/* Per-request driver data that blk-mq allocates behind each request. */
+struct blkram_cmd {
+    blk_status_t status; /* held until the request is completed */
+    struct work_struct work;
+    u64 start_ns; /* ->queue_rq() time, 0 if latency tracking was off */
+    struct hrtimer timer; /* completes the request after an injected delay */
+    u64 deadline_ns; /* ... or, on a poll queue, the time it is due */
+};
+
+static int blkram_major;
+static struct workqueue_struct *blkram_wq;
+static struct dentry *blkram_debugfs;
+
+/* blkram_lock serializes creating and destroying disks. */
+static DEFINE_MUTEX(blkram_lock);
+static LIST_HEAD(blkram_devs);
+static DEFINE_IDA(blkram_ida);
+
+/* Latency tracking is off until enabled through debugfs; while off, the
+ * static key leaves a single patched-out jump in the I/O path.
+ */
+static DEFINE_STATIC_KEY_FALSE(blkram_lat_enabled);
+
+/* kmap_local_page() appeared in 5.11; fall back to kmap_atomic() on 5.10. */
+static void *blkram_kmap(struct page *page)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    return kmap_local_page(page);
+#else
+    return kmap_atomic(page);
+#endif
+}
+
+static void blkram_kunmap(void *addr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    kunmap_local(addr);
+#else
+    kunmap_atomic(addr);
+#endif
+}
+
+static int blkram_page_node(struct blkram_dev *dev, pgoff_t idx)
+{
+    switch (dev->numa_policy) {
+    case BLKRAM_NUMA_INTERLEAVE:
+        return dev->mem_nodes[idx % dev->nr_mem_nodes];
+    case BLKRAM_NUMA_BIND:
+        return dev->numa_node;
+    default:
+        /* The allocating CPU is the submitter, or in async mode a worker
+         * bound to the submitter's CPU, so "local" is the submitter's node.
+         */
+        return NUMA_NO_NODE;
+    }
+}
+
+/* What a read of page @idx sees: the live map, then the snapshot under it.
+ * Called under RCU.
+ */
+static void *blkram_lookup(struct blkram_dev *dev, pgoff_t idx)
+{
+    void *entry = xa_load(dev->pages, idx);
+
+    if (!entry && dev->snap)
+        entry = xa_load(dev->snap, idx);
+
+    return entry;
+}
+
+/* The sector offsets and lengths used here are multiples of 4 bytes. */
+static void blkram_fill(void *buf, void *entry, unsigned int len)
+{
+    memset32(buf, xa_to_value(entry), len / sizeof(u32));
+}
+
+/* Install a page at @idx in place of @old, which is NULL or a same-filled
+ * value entry. The page starts out with what a read sees there, so after a
+ * snapshot this is the copy in copy-on-write. Two writers racing on the same
+ * index may both allocate; xa_cmpxchg() decides which page gets installed
+ * and the loser frees its copy.
+ */
+static int blkram_alloc_page(struct blkram_dev *dev, pgoff_t idx, void *old)
+{
+    struct page *page, *cur;
+    void *src, *mem;
+
+    page = alloc_pages_node(blkram_page_node(dev, idx),
+                            GFP_NOIO | __GFP_HIGHMEM, 0);
+    if (!page)
+        return -ENOMEM;
+
+    mem = blkram_kmap(page);
+    rcu_read_lock();
+    src = old ?: blkram_lookup(dev, idx);
+    if (!src) {
+        memset(mem, 0, PAGE_SIZE);
+    } else if (xa_is_value(src)) {
+        blkram_fill(mem, src, PAGE_SIZE);
+    } else {
+        void *from = blkram_kmap(src);
+
+        memcpy(mem, from, PAGE_SIZE);
+        blkram_kunmap(from);
+    }
+    rcu_read_unlock();
+    blkram_kunmap(mem);
+
+    cur = xa_cmpxchg(dev->pages, idx, old, page, GFP_NOIO);
+    if (cur != old) {
+        __free_page(page);
+        if (xa_is_err(cur))
+            return xa_err(cur);
+        return 0;
+    }
+
+    atomic_long_inc(&dev->node_pages[page_to_nid(page)]);
+
+    return 0;
+}
+
+static void blkram_free_page_rcu(struct rcu_head *head)
+{
+    __free_page(container_of(head, struct page, rcu_head));
+}
+
+/* Readers and writers look pages up and copy under rcu_read_lock(), so a
+ * page removed by discard is only returned to the allocator once every
+ * copy that might still be using it has finished.
+ */
+static void blkram_free_page(struct blkram_dev *dev, struct page *page)
+{
+    atomic_long_dec(&dev->node_pages[page_to_nid(page)]);
+    call_rcu(&page->rcu_head, blkram_free_page_rcu);
+}
+
+static void blkram_zobj_free(struct blkram_zobj *obj)
+{
+    if (obj->page)
+        __free_page(obj->page);
+    kfree(obj);
+}
+
+static void blkram_zobj_free_rcu(struct rcu_head *head)
+{
+    blkram_zobj_free(container_of(head, struct blkram_zobj, rcu));
+}
+
+/* Add (@delta = 1) or remove (@delta = -1) a compressed store entry from
+ * the statistics.
+ */
+static void blkram_zaccount(struct blkram_dev *dev, void *entry, int delta)
+{
+    struct blkram_zobj *obj = entry;
+
+    if (!entry)
+        return;
+
+    atomic_long_add(delta, &dev->z_pages);
+    if (xa_is_value(entry)) {
+        atomic_long_add(delta, &dev->z_same);
+        return;
+    }
+    if (obj->page)
+        atomic_long_add(delta, &dev->z_huge);
+    atomic64_add(delta * (s64)obj->len, &dev->z_bytes);
+}
+
+/* Release an entry that has just been taken out of the store. */
+static void blkram_free_entry(struct blkram_dev *dev, void *entry)
+{
+    struct blkram_zobj *obj = entry;
+
+    if (!dev->compress) {
+        if (!xa_is_value(entry))
+            blkram_free_page(dev, entry);
+        return;
+    }
+
+    blkram_zaccount(dev, entry, -1);
+    if (!xa_is_value(entry))
+        call_rcu(&obj->rcu, blkram_zobj_free_rcu);
+}
+
+static void blkram_free_map(struct blkram_dev *dev, struct xarray *map)
+{
+    unsigned long idx;
+    void *entry;
+
+    xa_for_each(map, idx, entry)
+    {
+        if (xa_is_value(entry))
+            continue;
+        if (dev->compress)
+            blkram_zobj_free(entry);
+        else
+            __free_page(entry);
+    }
+    xa_destroy(map);
+}
+
+static void blkram_free_pages(struct blkram_dev *dev)
+{
+    blkram_free_map(dev, &dev->maps[0]);
+    blkram_free_map(dev, &dev->maps[1]);
+}
+
+/* Compressed store. Reads decompress under RCU, straight into the I/O page
+ * when a whole page is read and through a per-CPU bounce page otherwise.
+ * Writes are read-modify-write of a whole page under the page's stripe lock,
+ * and publish the new entry with xa_store(); whoever takes an entry out of
+ * the array frees it, after a grace period.
+ */
+static int blkram_lz4_compress(struct blkram_dev *dev,
+                               struct blkram_zstripe *st)
+{
+    int len = 0;
+#if BLKRAM_HAVE_LZ4
+    u64 start = ktime_get_ns();
+
+    len = LZ4_compress_default(st->buf, st->cbuf, PAGE_SIZE, BLKRAM_ZMAX_LEN,
+                               st->wmem);
+    this_cpu_inc(dev->zstat->comp_calls);
+    this_cpu_add(dev->zstat->comp_ns, ktime_get_ns() - start);
+#endif
+    return len; /* 0 if the page does not fit in BLKRAM_ZMAX_LEN */
+}
+
+static int blkram_lz4_decompress(struct blkram_dev *dev,
+                                 const struct blkram_zobj *obj, void *dst)
+{
+    int ret = -EIO;
+#if BLKRAM_HAVE_LZ4
+    u64 start = ktime_get_ns();
+
+    ret = LZ4_decompress_safe((const char *)obj->data, dst, obj->len,
+                              PAGE_SIZE);
+    this_cpu_inc(dev->zstat->decomp_calls);
+    this_cpu_add(dev->zstat->decomp_ns, ktime_get_ns() - start);
+#endif
+    return ret == PAGE_SIZE ? 0 : -EIO;
+}
+
+/* Expand @entry into the page-sized buffer @dst. Called under RCU. */
+static int blkram_zload(struct blkram_dev *dev, void *entry, void *dst)
+{
+    struct blkram_zobj *obj = entry;
+
+    if (!entry) {
+        memset(dst, 0, PAGE_SIZE);
+    } else if (xa_is_value(entry)) {
+        memset32(dst, xa_to_value(entry), PAGE_SIZE / sizeof(u32));
+    } else if (obj->page) {
+        void *mem = blkram_kmap(obj->page);
+
+        memcpy(dst, mem, PAGE_SIZE);
+        blkram_kunmap(mem);
+    } else {
+        return blkram_lz4_decompress(dev, obj, dst);
+    }
+
+    return 0;
+}
+
+/* Value entries hold an unsigned long shifted left by one, so on 32-bit a
+ * pattern with the top bit set does not fit and is compressed instead.
+ */
+static bool blkram_same_filled(const void *buf, u32 *pattern)
+{
+    const u32 *word = buf;
+    unsigned int i;
+
+    for (i = 1; i < PAGE_SIZE / sizeof(u32); i++) {
+        if (word[i] != word[0])
+            return false;
+    }
+    *pattern = word[0];
+
+    return BITS_PER_LONG > 32 || *pattern <= LONG_MAX;
+}
+
+/* Turn the stripe's page buffer into a store entry. */
+static void *blkram_zpack(struct blkram_dev *dev, struct blkram_zstripe *st,
+                          pgoff_t idx)
+{
+    int node = blkram_page_node(dev, idx);
+    struct blkram_zobj *obj;
+    u32 pattern;
+    int len;
+
+    if (blkram_same_filled(st->buf, &pattern))
+        return xa_mk_value(pattern);
+
+    len = blkram_lz4_compress(dev, st);
+    obj = kmalloc_node(struct_size(obj, data, len), GFP_NOIO, node);
+    if (!obj)
+        return ERR_PTR(-ENOMEM);
+
+    obj->page = NULL;
+    obj->len = len;
+    if (len) {
+        memcpy(obj->data, st->cbuf, len);
+    } else {
+        void *mem;
+
+        obj->page = alloc_pages_node(node, GFP_NOIO | __GFP_HIGHMEM, 0);
+        if (!obj->page) {
+            kfree(obj);
+            return ERR_PTR(-ENOMEM);
+        }
+        obj->len = PAGE_SIZE;
+        mem = blkram_kmap(obj->page);
+        memcpy(mem, st->buf, PAGE_SIZE);
+        blkram_kunmap(mem);
+    }
+
+    return obj;
+}
+
+/* Write @len bytes at @offset into page @idx, from @src at @src_off, or
+ * zeroes if @src is NULL.
+ */
+static int blkram_zwrite(struct blkram_dev *dev, pgoff_t idx,
+                         unsigned int offset, unsigned int len,
+                         struct page *src, unsigned int src_off)
+{
+    struct blkram_zstripe *st = &dev->zstripes[idx & (dev->nr_zstripes - 1)];
+    void *entry, *old;
+    int err = 0;
+
+    mutex_lock(&st->lock);
+
+    if (len < PAGE_SIZE || !src) {
+        rcu_read_lock();
+        entry = blkram_lookup(dev, idx);
+        /* Zeroing a page that was never written is a no-op. */
+        if (!entry && !src) {
+            rcu_read_unlock();
+            goto out;
+        }
+        if (len < PAGE_SIZE)
+            err = blkram_zload(dev, entry, st->buf);
+        rcu_read_unlock();
+        if (err)
+            goto out;
+    }
+
+    if (src) {
+        void *mem = blkram_kmap(src);
+
+        memcpy(st->buf + offset, mem + src_off, len);
+        blkram_kunmap(mem);
+    } else {
+        memset(st->buf + offset, 0, len);
+    }
+
+    entry = blkram_zpack(dev, st, idx);
+    if (IS_ERR(entry)) {
+        err = PTR_ERR(entry);
+        goto out;
+    }
+
+    old = xa_store(dev->pages, idx, entry, GFP_NOIO);
+    if (xa_is_err(old)) {
+        err = xa_err(old);
+        if (!xa_is_value(entry))
+            blkram_zobj_free(entry);
+        goto out;
+    }
+    blkram_zaccount(dev, entry, 1);
+    if (old)
+        blkram_free_entry(dev, old);
+
+out:
+    mutex_unlock(&st->lock);
+    return err;
+}
+
+static int blkram_zread(struct blkram_dev *dev, pgoff_t idx,
+                        unsigned int offset, unsigned int len,
+                        struct page *dst, unsigned int dst_off)
+{
+    void *mem = blkram_kmap(dst) + dst_off;
+    void *entry;
+    int err;
+
+    rcu_read_lock();
+    entry = blkram_lookup(dev, idx);
+    if (len == PAGE_SIZE) {
+        err = blkram_zload(dev, entry, mem);
+    } else {
+        void *buf = *get_cpu_ptr(dev->zbuf);
+
+        err = blkram_zload(dev, entry, buf);
+        if (!err)
+            memcpy(mem, buf + offset, len);
+        put_cpu_ptr(dev->zbuf);
+    }
+    rcu_read_unlock();
+    blkram_kunmap(mem);
+
+    return err;
+}
+
+/* Whether a writer has to keep off page @idx because the shrinker is
+ * looking at it. Marks are rare, so the common case is one flag test.
+ * Called under RCU.
+ */
+static bool blkram_shrink_busy(struct blkram_dev *dev, pgoff_t idx)
+{
+    return xa_marked(dev->pages, BLKRAM_SHRINK_MARK) &&
+           xa_get_mark(dev->pages, idx, BLKRAM_SHRINK_MARK);
+}
+
+static void blkram_shrink_wait(struct blkram_dev *dev, pgoff_t idx)
+{
+    wait_event(dev->shrink_wq, !blkram_shrink_busy(dev, idx));
+}
+
+/* Copy @len bytes between offset @offset of backing page @idx and @io at
+ * @io_off. Reads of pages that were never written return zeroes without
+ * allocating anything.
+ */
+static int blkram_store_rw(struct blkram_dev *dev, pgoff_t idx,
+                           unsigned int offset, unsigned int len,
+                           struct page *io, unsigned int io_off, bool write)
+{
+    struct page *page;
+    void *iobuf;
+    int err;
+
+    if (dev->compress) {
+        if (write)
+            return blkram_zwrite(dev, idx, offset, len, io, io_off);
+        return blkram_zread(dev, idx, offset, len, io, io_off);
+    }
+
+    rcu_read_lock();
+    page = write ? xa_load(dev->pages, idx) : blkram_lookup(dev, idx);
+    while (write &&
+           (!page || xa_is_value(page) || blkram_shrink_busy(dev, idx))) {
+        /* Allocating and waiting for the shrinker may sleep, so do either
+         * outside the RCU section and look the page up again.
+         */
+        rcu_read_unlock();
+        if (page && !xa_is_value(page)) {
+            blkram_shrink_wait(dev, idx);
+        } else {
+            err = blkram_alloc_page(dev, idx, page);
+            if (err)
+                return err;
+        }
+        rcu_read_lock();
+        page = xa_load(dev->pages, idx);
+    }
+
+    iobuf = blkram_kmap(io) + io_off;
+    if (!page) {
+        memset(iobuf, 0, len);
+    } else if (xa_is_value(page)) {
+        blkram_fill(iobuf, page, len);
+    } else {
+        void *mem = blkram_kmap(page) + offset;
+
+        if (write)
+            memcpy(mem, iobuf, len);
+        else
+            memcpy(iobuf, mem, len);
+        blkram_kunmap(mem);
+    }
+    blkram_kunmap(iobuf);
+    rcu_read_unlock();
+
+    return 0;
+}
+
+/* Emulated volatile write cache. Writes land in dirty page copies held in
+ * dev->cache and only reach the store on a flush, a FUA write, or when the
+ * cache is full, in which case the write goes straight through. Readers
+ * check the cache first, under RCU; everything that adds, changes or
+ * removes a cached page holds the page's cache lock.
+ */
+static struct mutex *blkram_cache_lock(struct blkram_dev *dev, pgoff_t idx)
+{
+    return &dev->cache_locks[idx & (dev->nr_cache_locks - 1)];
+}
+
+static void blkram_copy_page(struct page *dst, unsigned int dst_off,
+                             struct page *src, unsigned int src_off,
+                             unsigned int len)
+{
+    void *to = blkram_kmap(dst);
+    void *from = blkram_kmap(src);
+
+    memcpy(to + dst_off, from + src_off, len);
+    blkram_kunmap(from);
+    blkram_kunmap(to);
+}
+
+/* Called with the page's cache lock held. */
+static void blkram_cache_drop(struct blkram_dev *dev, pgoff_t idx,
+                              struct page *cpage)
+{
+    xa_erase(&dev->cache, idx);
+    atomic_long_dec(&dev->cache_pages);
+    call_rcu(&cpage->rcu_head, blkram_free_page_rcu);
+}
+
+static int blkram_cache_read(struct blkram_dev *dev, pgoff_t idx,
+                             unsigned int offset, unsigned int len,
+                             struct page *io, unsigned int io_off)
+{
+    struct page *cpage;
+
+    rcu_read_lock();
+    cpage = xa_load(&dev->cache, idx);
+    if (cpage) {
+        blkram_copy_page(io, io_off, cpage, offset, len);
+        rcu_read_unlock();
+        return 0;
+    }
+    rcu_read_unlock();
+
+    return blkram_store_rw(dev, idx, offset, len, io, io_off, false);
+}
+
+static int blkram_cache_write(struct blkram_dev *dev, pgoff_t idx,
+                              unsigned int offset, unsigned int len,
+                              struct page *io, unsigned int io_off, bool fua)
+{
+    struct mutex *lock = blkram_cache_lock(dev, idx);
+    struct page *cpage, *old;
+    int err = 0;
+
+    mutex_lock(lock);
+    cpage = xa_load(&dev->cache, idx);
+
+    /* FUA data must be in the store when the request completes. A cached
+     * copy of the page is newer than the store, so it is updated as well.
+     */
+    if (fua || (!cpage && atomic_long_read(&dev->cache_pages) >=
+                              dev->cache_limit)) {
+        err = blkram_store_rw(dev, idx, offset, len, io, io_off, true);
+        if (!err && cpage)
+            blkram_copy_page(cpage, offset, io, io_off, len);
+        goto out;
+    }
+
+    if (cpage) {
+        blkram_copy_page(cpage, offset, io, io_off, len);
+        goto out;
+    }
+
+    /* Fill the new copy completely before readers can see it. */
+    cpage = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+    if (!cpage) {
+        err = -ENOMEM;
+        goto out;
+    }
+    if (len < PAGE_SIZE) {
+        err = blkram_store_rw(dev, idx, 0, PAGE_SIZE, cpage, 0, false);
+        if (err)
+            goto out_free;
+    }
+    blkram_copy_page(cpage, offset, io, io_off, len);
+
+    old = xa_store(&dev->cache, idx, cpage, GFP_NOIO);
+    if (xa_is_err(old)) {
+        err = xa_err(old);
+        goto out_free;
+    }
+    atomic_long_inc(&dev->cache_pages);
+    goto out;
+
+out_free:
+    __free_page(cpage);
+out:
+    mutex_unlock(lock);
+    return err;
+}
+
+/* Write every dirty page back to the store. Pages dirtied while the flush
+ * runs may or may not be included, which is all a flush promises.
+ */
+static int blkram_cache_flush(struct blkram_dev *dev)
+{
+    u64 start = ktime_get_ns();
+    struct page *cpage;
+    unsigned long idx;
+    int err = 0;
+
+    xa_for_each(&dev->cache, idx, cpage)
+    {
+        struct mutex *lock = blkram_cache_lock(dev, idx);
+
+        mutex_lock(lock);
+        /* A concurrent flush may have written it back already. */
+        cpage = xa_load(&dev->cache, idx);
+        if (cpage) {
+            err = blkram_store_rw(dev, idx, 0, PAGE_SIZE, cpage, 0, true);
+            if (!err)
+                blkram_cache_drop(dev, idx, cpage);
+        }
+        mutex_unlock(lock);
+        if (err)
+            break;
+    }
+
+    atomic64_inc(&dev->flushes);
+    atomic64_add(ktime_get_ns() - start, &dev->flush_ns);
+
+    return err;
+}
+
+/* Forget cached data for [@pos, @pos + @len) before the store is zeroed. */
+static void blkram_cache_zero(struct blkram_dev *dev, u64 pos, u64 len)
+{
+    unsigned long idx = pos >> PAGE_SHIFT;
+    pgoff_t last = (pos + len - 1) >> PAGE_SHIFT;
+    struct page *cpage;
+
+    cpage = xa_find(&dev->cache, &idx, last, XA_PRESENT);
+    while (cpage) {
+        struct mutex *lock = blkram_cache_lock(dev, idx);
+        u64 start = (u64)idx << PAGE_SHIFT;
+        unsigned int from = max(pos, start) - start;
+        unsigned int to = min(pos + len, start + PAGE_SIZE) - start;
+
+        mutex_lock(lock);
+        cpage = xa_load(&dev->cache, idx);
+        if (cpage && to - from == PAGE_SIZE) {
+            blkram_cache_drop(dev, idx, cpage);
+        } else if (cpage) {
+            void *mem = blkram_kmap(cpage);
+
+            memset(mem + from, 0, to - from);
+            blkram_kunmap(mem);
+        }
+        mutex_unlock(lock);
+
+        cpage = xa_find_after(&dev->cache, &idx, last, XA_PRESENT);
+    }
+}
+
+/* Drop everything that was not flushed, as a power failure would. */
+static void blkram_cache_power_loss(struct blkram_dev *dev)
+{
+    struct page *cpage;
+    unsigned long idx;
+
+    xa_for_each(&dev->cache, idx, cpage)
+    {
+        struct mutex *lock = blkram_cache_lock(dev, idx);
+
+        mutex_lock(lock);
+        cpage = xa_load(&dev->cache, idx);
+        if (cpage)
+            blkram_cache_drop(dev, idx, cpage);
+        mutex_unlock(lock);
+    }
+}
+
+/* Copy one single-page bio_vec to or from the disk. @pos is the byte offset
+ * on the disk, which need not be page aligned, so a segment may straddle two
+ * backing pages.
+ */
+static int blkram_do_bvec(struct blkram_dev *dev, const struct bio_vec *bvec,
+                          u64 pos, bool write, bool fua)
+{
+    unsigned int done = 0;
+    int err;
+
+    while (done < bvec->bv_len) {
+        unsigned int offset = offset_in_page(pos);
+        unsigned int len =
+            min_t(unsigned int, bvec->bv_len - done, PAGE_SIZE - offset);
+        unsigned int io_off = bvec->bv_offset + done;
+        pgoff_t idx = pos >> PAGE_SHIFT;
+
+        if (!dev->cache_limit)
+            err = blkram_store_rw(dev, idx, offset, len, bvec->bv_page,
+                                  io_off, write);
+        else if (write)
+            err = blkram_cache_write(dev, idx, offset, len, bvec->bv_page,
+                                     io_off, fua);
+        else
+            err = blkram_cache_read(dev, idx, offset, len, bvec->bv_page,
+                                    io_off);
+        if (err)
+            return err;
+
+        done += len;
+        pos += len;
+    }
+
+    if (!write)
+        flush_dcache_page(bvec->bv_page);
+
+    return 0;
+}
+
+static blk_status_t blkram_transfer(struct blkram_dev *dev, struct request *rq)
+{
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    u64 pos = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+    bool write = rq_data_dir(rq) == WRITE;
+    bool fua = rq->cmd_flags & REQ_FUA;
+    int err;
+
+    rq_for_each_segment(bvec, rq, iter)
+    {
+        err = blkram_do_bvec(dev, &bvec, pos, write, fua);
+        if (err)
+            return errno_to_blk_status(err);
+        pos += bvec.bv_len;
+    }
+
+    return BLK_STS_OK;
+}
+
+/* Drop whole pages @first..@last from the store. Under a snapshot, pages
+ * the snapshot has are hidden by a zero pattern entry instead.
+ */
+static int blkram_unmap_pages(struct blkram_dev *dev, pgoff_t first,
+                              pgoff_t last)
+{
+    void *zero = xa_mk_value(0);
+    unsigned long i = first;
+    void *entry, *old;
+
+    /* Only visit pages that exist, so discarding a huge mostly empty range
+     * does not walk every index in it. What xa_find() returned may already
+     * be gone by the time it is taken out, freed by an overlapping discard
+     * or replaced by a writer, so only the entry that xa_erase() or
+     * xa_store() actually removed is freed.
+     */
+    entry = xa_find(dev->pages, &i, last, XA_PRESENT);
+    while (entry) {
+        if (!dev->snap || !xa_load(dev->snap, i)) {
+            old = xa_erase(dev->pages, i);
+        } else if (entry != zero) {
+            /* Replacing an entry needs no allocation, so cannot fail. */
+            old = xa_store(dev->pages, i, zero, GFP_NOIO);
+            if (dev->compress)
+                blkram_zaccount(dev, zero, 1);
+        } else {
+            old = NULL;
+        }
+        if (old)
+            blkram_free_entry(dev, old);
+        entry = xa_find_after(dev->pages, &i, last, XA_PRESENT);
+    }
+    if (!dev->snap)
+        return 0;
+
+    i = first;
+    entry = xa_find(dev->snap, &i, last, XA_PRESENT);
+    while (entry) {
+        old = xa_cmpxchg(dev->pages, i, NULL, zero, GFP_NOIO);
+        if (xa_is_err(old))
+            return xa_err(old);
+        if (!old && dev->compress)
+            blkram_zaccount(dev, zero, 1);
+        entry = xa_find_after(dev->snap, &i, last, XA_PRESENT);
+    }
+
+    return 0;
+}
+
+/* Zero @len bytes at @pos. Whole pages are dropped from the store when
+ * @unmap is set, which is what makes discard give memory back; partial pages
+ * at either end are cleared in place.
+ */
+static int blkram_zero_range(struct blkram_dev *dev, u64 pos, u64 len,
+                             bool unmap)
+{
+    if (dev->cache_limit && len)
+        blkram_cache_zero(dev, pos, len);
+
+    while (len) {
+        unsigned int offset = offset_in_page(pos);
+        u64 chunk = min_t(u64, len, PAGE_SIZE - offset);
+        pgoff_t idx = pos >> PAGE_SHIFT;
+        struct page *page;
+        int err;
+
+        if (unmap && chunk == PAGE_SIZE) {
+            pgoff_t last = (pos + len) / PAGE_SIZE - 1;
+
+            err = blkram_unmap_pages(dev, idx, last);
+            if (err)
+                return err;
+            chunk = (u64)(last - idx + 1) << PAGE_SHIFT;
+        } else if (dev->compress) {
+            err = blkram_zwrite(dev, idx, offset, chunk, NULL, 0);
+            if (err)
+                return err;
+        } else {
+            void *entry;
+
+            rcu_read_lock();
+            page = xa_load(dev->pages, idx);
+            if (page && !xa_is_value(page) && blkram_shrink_busy(dev, idx)) {
+                rcu_read_unlock();
+                blkram_shrink_wait(dev, idx);
+                continue;
+            }
+            if (page && !xa_is_value(page)) {
+                void *mem = blkram_kmap(page);
+
+                memset(mem + offset, 0, chunk);
+                blkram_kunmap(mem);
+                rcu_read_unlock();
+                goto next;
+            }
+            entry = blkram_lookup(dev, idx);
+            rcu_read_unlock();
+
+            /* Anything else but a page of zeroes needs a page of its own
+             * first, which the zero page can be written through.
+             */
+            if (entry && entry != xa_mk_value(0)) {
+                err = blkram_store_rw(dev, idx, offset, chunk, ZERO_PAGE(0),
+                                      0, true);
+                if (err)
+                    return err;
+            }
+        }
+
+next:
+        pos += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+#if BLKRAM_HAVE_ZONED
+/* Zoned mode. Sequential zones only take writes at their write pointer, or
+ * zone appends, which the driver places at the write pointer and reports
+ * back through the request's sector. Zone write plugging in the block layer
+ * already orders writes per zone; the zone lock keeps the write pointer
+ * consistent with management operations and zone reports.
+ */
+static struct blkram_zone *blkram_zone(struct blkram_dev *dev, sector_t sector)
+{
+    return &dev->zones[sector >> ilog2(dev->zone_sectors)];
+}
+
+static bool blkram_zone_is_open(const struct blkram_zone *zone)
+{
+    return zone->cond == BLK_ZONE_COND_IMP_OPEN ||
+           zone->cond == BLK_ZONE_COND_EXP_OPEN;
+}
+
+static blk_status_t blkram_zone_write(struct blkram_dev *dev,
+                                      struct request *rq)
+{
+    struct blkram_zone *zone = blkram_zone(dev, blk_rq_pos(rq));
+    bool append = req_op(rq) == REQ_OP_ZONE_APPEND;
+    blk_status_t status = BLK_STS_IOERR;
+
+    mutex_lock(&zone->lock);
+
+    if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+        if (!append)
+            status = blkram_transfer(dev, rq);
+        goto out;
+    }
+
+    if (zone->cond == BLK_ZONE_COND_FULL)
+        goto out;
+    if (append)
+        rq->__sector = zone->wp;
+    else if (blk_rq_pos(rq) != zone->wp)
+        goto out;
+    if (zone->wp + blk_rq_sectors(rq) > zone->start + dev->zone_sectors)
+        goto out;
+
+    status = blkram_transfer(dev, rq);
+    if (status != BLK_STS_OK)
+        goto out;
+
+    zone->wp += blk_rq_sectors(rq);
+    if (zone->wp == zone->start + dev->zone_sectors)
+        zone->cond = BLK_ZONE_COND_FULL;
+    else if (zone->cond != BLK_ZONE_COND_EXP_OPEN)
+        zone->cond = BLK_ZONE_COND_IMP_OPEN;
+
+out:
+    mutex_unlock(&zone->lock);
+    return status;
+}
+
+/* Called with the zone lock held. */
+static int blkram_zone_reset(struct blkram_dev *dev, struct blkram_zone *zone)
+{
+    zone->wp = zone->start;
+    zone->cond = BLK_ZONE_COND_EMPTY;
+
+    return blkram_zero_range(dev, (u64)zone->start << SECTOR_SHIFT,
+                             (u64)dev->zone_sectors << SECTOR_SHIFT, true);
+}
+
+static blk_status_t blkram_zone_mgmt(struct blkram_dev *dev,
+                                     struct request *rq)
+{
+    struct blkram_zone *zone;
+    unsigned int i;
+    int err = 0;
+
+    if (req_op(rq) == REQ_OP_ZONE_RESET_ALL) {
+        for (i = 0; i < dev->nr_zones && !err; i++) {
+            zone = &dev->zones[i];
+            if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+                continue;
+            mutex_lock(&zone->lock);
+            err = blkram_zone_reset(dev, zone);
+            mutex_unlock(&zone->lock);
+        }
+        return errno_to_blk_status(err);
+    }
+
+    zone = blkram_zone(dev, blk_rq_pos(rq));
+    if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+        return BLK_STS_IOERR;
+
+    mutex_lock(&zone->lock);
+    switch (req_op(rq)) {
+    case REQ_OP_ZONE_RESET:
+        err = blkram_zone_reset(dev, zone);
+        break;
+    case REQ_OP_ZONE_OPEN:
+        if (zone->cond == BLK_ZONE_COND_FULL)
+            err = -EIO;
+        else
+            zone->cond = BLK_ZONE_COND_EXP_OPEN;
+        break;
+    case REQ_OP_ZONE_CLOSE:
+        if (blkram_zone_is_open(zone))
+            zone->cond = zone->wp == zone->start ? BLK_ZONE_COND_EMPTY :
+                                                   BLK_ZONE_COND_CLOSED;
+        break;
+    case REQ_OP_ZONE_FINISH:
+        zone->wp = zone->start + dev->zone_sectors;
+        zone->cond = BLK_ZONE_COND_FULL;
+        break;
+    default:
+        err = -EOPNOTSUPP;
+        break;
+    }
+    mutex_unlock(&zone->lock);
+
+    return errno_to_blk_status(err);
+}
+
+static int blkram_report_zones(struct gendisk *disk, sector_t sector,
+                               unsigned int nr_zones, report_zones_cb cb,
+                               void *data)
+{
+    struct blkram_dev *dev = disk->private_data;
+    unsigned int first = sector >> ilog2(dev->zone_sectors);
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < nr_zones && first + i < dev->nr_zones; i++) {
+        struct blkram_zone *zone = &dev->zones[first + i];
+        struct blk_zone blkz = {
+            .start = zone->start,
+            .len = dev->zone_sectors,
+            .capacity = dev->zone_sectors,
+            .type = zone->type,
+        };
+
+        mutex_lock(&zone->lock);
+        blkz.wp = zone->wp;
+        blkz.cond = zone->cond;
+        mutex_unlock(&zone->lock);
+
+        ret = cb(&blkz, i, data);
+        if (ret)
+            return ret;
+    }
+
+    return i;
+}
+#endif
+
+/* While the backing file is being loaded, I/O that reaches past what the
+ * loader has stored so far waits for it, so the loader never overwrites
+ * newer data and nothing reads a page before its contents arrive. Once
+ * loading is over this is a single load and compare.
+ */
+static void blkram_wait_loaded(struct blkram_dev *dev, u64 pos, u64 len)
+{
+    pgoff_t last = (pos + len - 1) >> PAGE_SHIFT;
+
+    if (len)
+        wait_event(dev->load_wq, smp_load_acquire(&dev->load_next) > last);
+}
+
+static blk_status_t blkram_handle_rq(struct blkram_dev *dev,
+                                     struct request *rq)
+{
+    u64 pos = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+    u64 len = blk_rq_bytes(rq);
+
+    if (blk_rq_is_passthrough(rq))
+        return BLK_STS_IOERR;
+    /* The block layer turns REQ_PREFLUSH into a separate flush request, and
+     * only sends any once a write cache is advertised. It carries no data
+     * and its sector is left at (sector_t)-1, so it must not reach the
+     * range check below.
+     */
+    if (req_op(rq) == REQ_OP_FLUSH) {
+        if (!dev->cache_limit)
+            return BLK_STS_OK;
+        return errno_to_blk_status(blkram_cache_flush(dev));
+    }
+
+    if (pos + len > dev->size)
+        return BLK_STS_IOERR;
+    blkram_wait_loaded(dev, pos, len);
+
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+        return blkram_transfer(dev, rq);
+    case REQ_OP_WRITE:
+#if BLKRAM_HAVE_ZONED
+        if (dev->zones)
+            return blkram_zone_write(dev, rq);
+#endif
+        return blkram_transfer(dev, rq);
+#if BLKRAM_HAVE_ZONED
+    case REQ_OP_ZONE_APPEND:
+        return blkram_zone_write(dev, rq);
+    case REQ_OP_ZONE_RESET:
+    case REQ_OP_ZONE_RESET_ALL:
+    case REQ_OP_ZONE_OPEN:
+    case REQ_OP_ZONE_CLOSE:
+    case REQ_OP_ZONE_FINISH:
+        return blkram_zone_mgmt(dev, rq);
+#endif
+    case REQ_OP_DISCARD:
+        return errno_to_blk_status(blkram_zero_range(dev, pos, len, true));
+    case REQ_OP_WRITE_ZEROES:
+        /* REQ_NOUNMAP asks for the range to stay provisioned. */
+        return errno_to_blk_status(blkram_zero_range(
+            dev, pos, len, !(rq->cmd_flags & REQ_NOUNMAP)));
+    default:
+        return BLK_STS_NOTSUPP;
+    }
+}
+
+static enum blkram_lat_op blkram_lat_op(unsigned int op)
+{
+    switch (op) {
+    case REQ_OP_READ:
+        return BLKRAM_LAT_READ;
+    case REQ_OP_WRITE:
+        return BLKRAM_LAT_WRITE;
+    default:
+        return BLKRAM_LAT_OTHER;
+    }
+}
+
+static void blkram_lat_add(struct blkram_dev *dev, struct request *rq,
+                           enum blkram_lat_stage stage, u64 ns)
+{
+    unsigned int bytes = blk_rq_bytes(rq);
+    int op = blkram_lat_op(req_op(rq));
+    int size, bucket;
+
+    if (bytes <= SZ_4K)
+        size = BLKRAM_LAT_4K;
+    else if (bytes <= SZ_64K)
+        size = BLKRAM_LAT_64K;
+    else if (bytes <= SZ_512K)
+        size = BLKRAM_LAT_512K;
+    else
+        size = BLKRAM_LAT_LARGER;
+
+    bucket = ns ? min(fls64(ns) - 1, BLKRAM_LAT_BUCKETS - 1) : 0;
+
+    /* Each CPU only ever writes its own copy, so no lock and no atomic. */
+    this_cpu_inc(dev->lat->hist[stage][op][size][bucket]);
+}
+
+/* Note when the driver first saw the request, and how long the block layer
+ * held it before that. rq->start_time_ns is only set while I/O accounting
+ * or a scheduler needs it, hence the check.
+ */
+static void blkram_lat_start(struct blkram_dev *dev, struct request *rq)
+{
+    struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    cmd->start_ns = 0;
+    if (!static_branch_unlikely(&blkram_lat_enabled))
+        return;
+
+    cmd->start_ns = ktime_get_ns();
+    if (rq->start_time_ns)
+        blkram_lat_add(dev, rq, BLKRAM_LAT_Q2S,
+                       cmd->start_ns - rq->start_time_ns);
+}
+
+/* Fault and latency injection. Settings are read without a lock, each on
+ * its own, so a change takes effect from the next I/O on.
+ */
+static bool blkram_inject_error(struct blkram_dev *dev, unsigned int op)
+{
+    u32 ppm = READ_ONCE(dev->inject.error_ppm[blkram_lat_op(op)]);
+
+    return ppm && get_random_u32() % 1000000 < ppm;
+}
+
+/* Injected delay for the next completion, in nanoseconds. */
+static u64 blkram_inject_delay(struct blkram_dev *dev)
+{
+    struct blkram_inject *inj = &dev->inject;
+    u64 min = READ_ONCE(inj->delay_ns);
+    u64 max;
+
+    switch (READ_ONCE(inj->delay_mode)) {
+    case BLKRAM_DELAY_FIXED:
+        return min;
+    case BLKRAM_DELAY_UNIFORM:
+        max = READ_ONCE(inj->delay_max_ns);
+        if (max <= min)
+            return min;
+        return min + mul_u64_u32_shr(max - min, get_random_u32(), 32);
+    case BLKRAM_DELAY_TAIL:
+        if (get_random_u32() % 1000000 < READ_ONCE(inj->tail_ppm))
+            return READ_ONCE(inj->tail_ns);
+        return min;
+    default:
+        return 0;
+    }
+}
+
+/* Hold the completion of @rq back by an injected delay, if there is one.
+ * The wait is an hrtimer rather than a sleep or a spin, so neither the
+ * submitter nor a worker is kept busy in the meantime.
+ */
+static bool blkram_delay_rq(struct blkram_dev *dev, struct request *rq)
+{
+    struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    u64 delay = blkram_inject_delay(dev);
+
+    if (!delay)
+        return false;
+
+    hrtimer_start(&cmd->timer, ns_to_ktime(delay), HRTIMER_MODE_REL);
+    return true;
+}
+
+static blk_status_t blkram_exec_rq(struct blkram_dev *dev, struct request *rq)
+{
+    struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    blk_status_t status;
+    u64 start;
+
+    /* A failed request is not carried out at all. */
+    if (blkram_inject_error(dev, req_op(rq)))
+        return BLK_STS_IOERR;
+
+    if (!cmd->start_ns)
+        return blkram_handle_rq(dev, rq);
+
+    start = ktime_get_ns();
+    status = blkram_handle_rq(dev, rq);
+    blkram_lat_add(dev, rq, BLKRAM_LAT_COPY, ktime_get_ns() - start);
+
+    return status;
+}
+
+/* Count a completed I/O. Like the latency histograms these are per-CPU,
+ * so completions on different CPUs never share a cache line; this_cpu ops
+ * are also safe against the timer interrupt completing a delayed request.
+ */
+static void blkram_stat_add(struct blkram_dev *dev, unsigned int op,
+                            unsigned int bytes, unsigned int segments,
+                            unsigned int merges, bool error)
+{
+    int i = blkram_lat_op(op);
+
+    this_cpu_inc(dev->stat->ios[i]);
+    this_cpu_add(dev->stat->bytes[i], bytes);
+    this_cpu_add(dev->stat->segments[i], segments);
+    if (merges)
+        this_cpu_add(dev->stat->merges[i], merges);
+    if (error)
+        this_cpu_inc(dev->stat->errors[i]);
+}
+
+static void blkram_end_rq(struct request *rq)
+{
+    struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    unsigned int bios = 0;
+    struct bio *bio;
+
+    if (cmd->start_ns) {
+        u64 start = rq->start_time_ns ?: cmd->start_ns;
+
+        blkram_lat_add(rq->q->queuedata, rq, BLKRAM_LAT_TOTAL,
+                       ktime_get_ns() - start);
+    }
+
+    /* Every bio after the first was merged into the request. */
+    __rq_for_each_bio(bio, rq)
+    {
+        bios++;
+    }
+    blkram_stat_add(rq->q->queuedata, req_op(rq), blk_rq_bytes(rq),
+                    blk_rq_nr_phys_segments(rq), bios ? bios - 1 : 0,
+                    cmd->status != BLK_STS_OK);
+
+    blk_mq_end_request(rq, cmd->status);
+}
+
+/* Runs concurrently on every hardware queue. The only shared state is the
+ * page xarray, whose lookups are lock-free; its lock is taken only when a
+ * page is installed or removed.
+ */
+static blk_status_t blkram_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                    const struct blk_mq_queue_data *bd)
+{
+    struct request *rq = bd->rq;
+    struct blkram_dev *dev = rq->q->queuedata;
+    struct blkram_queue *bq = hctx->driver_data;
+    struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    blk_mq_start_request(rq);
+    blkram_lat_start(dev, rq);
+
+    /* In async mode the submitter only queues the request; the copy runs
+     * in a worker bound to this CPU, and the completion comes back through
+     * blk_mq_complete_request() as it would from a device interrupt.
+     */
+    if (dev->async && hctx->type != HCTX_TYPE_POLL) {
+        this_cpu_inc(*dev->async_inflight);
+        queue_work(blkram_wq, &cmd->work);
+        return BLK_STS_OK;
+    }
+
+    cmd->status = blkram_exec_rq(dev, rq);
+
+    /* Requests on a poll queue are not completed here. They are parked on
+     * the queue's list and completed when the submitter calls ->poll(),
+     * just as a real device's completion would be reaped from its CQ. An
+     * injected delay makes them due later rather than arming a timer.
+     */
+    if (hctx->type == HCTX_TYPE_POLL) {
+        u64 delay = blkram_inject_delay(dev);
+
+        cmd->deadline_ns = delay ? ktime_get_ns() + delay : 0;
+        spin_lock(&bq->poll_lock);
+        list_add_tail(&rq->queuelist, &bq->poll_list);
+        spin_unlock(&bq->poll_lock);
+        return BLK_STS_OK;
+    }
+
+    if (!blkram_delay_rq(dev, rq))
+        blkram_end_rq(rq);
+
+    return BLK_STS_OK;
+}
+
+static void blkram_work(struct work_struct *work)
+{
+    struct blkram_cmd *cmd = container_of(work, struct blkram_cmd, work);
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+    cmd->status = blkram_exec_rq(rq->q->queuedata, rq);
+    if (!blkram_delay_rq(rq->q->queuedata, rq))
+        blk_mq_complete_request(rq);
+}
+
+/* The end of an injected delay. Completing from hard interrupt context is
+ * what a real device's interrupt handler does too.
+ */
+static enum hrtimer_restart blkram_timer_fn(struct hrtimer *timer)
+{
+    struct blkram_cmd *cmd = container_of(timer, struct blkram_cmd, timer);
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    struct blkram_dev *dev = rq->q->queuedata;
+
+    if (dev->async)
+        blk_mq_complete_request(rq);
+    else
+        blkram_end_rq(rq);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Called wherever blk_mq_complete_request() decides to complete: on the
+ * submitting CPU after an IPI if the worker's CPU does not share a cache
+ * with it, otherwise locally. Neither that CPU nor the one that ran
+ * ->queue_rq() (kblockd may run it elsewhere with BLK_MQ_F_BLOCKING) need
+ * be the one whose async_inflight counter was incremented, so individual
+ * per-CPU values can go negative and only their sum means anything.
+ */
+static void blkram_complete_rq(struct request *rq)
+{
+    struct blkram_dev *dev = rq->q->queuedata;
+
+    this_cpu_dec(*dev->async_inflight);
+    blkram_end_rq(rq);
+}
+
+static int blkram_init_request(struct blk_mq_tag_set *set, struct request *rq,
+                               unsigned int hctx_idx, unsigned int numa_node)
+{
+    struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    INIT_WORK(&cmd->work, blkram_work);
+    /* hrtimer_setup() replaced hrtimer_init() in 6.13. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&cmd->timer, blkram_timer_fn, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cmd->timer.function = blkram_timer_fn;
+#endif
+
+    return 0;
+}
+
+/* ->poll() gained an io_comp_batch argument in 5.16. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static int blkram_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+#else
+static int blkram_poll(struct blk_mq_hw_ctx *hctx)
+#endif
+{
+    struct blkram_queue *bq = hctx->driver_data;
+    LIST_HEAD(list);
+    LIST_HEAD(later);
+    u64 now = 0;
+    int nr = 0;
+
+    spin_lock(&bq->poll_lock);
+    list_splice_init(&bq->poll_list, &list);
+    spin_unlock(&bq->poll_lock);
+
+    while (!list_empty(&list)) {
+        struct request *rq =
+            list_first_entry(&list, struct request, queuelist);
+        struct blkram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+        if (cmd->deadline_ns) {
+            now = now ?: ktime_get_ns();
+            if (now < cmd->deadline_ns) {
+                list_move_tail(&rq->queuelist, &later);
+                continue;
+            }
+        }
+        list_del_init(&rq->queuelist);
+        blkram_end_rq(rq);
+        nr++;
+    }
+
+    /* Whatever is not due yet goes back in front, in order. */
+    if (!list_empty(&later)) {
+        spin_lock(&bq->poll_lock);
+        list_splice(&later, &bq->poll_list);
+        spin_unlock(&bq->poll_lock);
+    }
+
+    return nr;
+}
+
+/* Lay the hardware queues out as [default queues][poll queues]. There are
+ * no dedicated read queues. ->map_queues() returns void since 6.1.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+static void blkram_map_queues(struct blk_mq_tag_set *set)
+#else
+static int blkram_map_queues(struct blk_mq_tag_set *set)
+#endif
+{
+    struct blkram_dev *dev = set->driver_data;
+    unsigned int offset = 0;
+    int i;
+
+    for (i = 0; i < set->nr_maps; i++) {
+        struct blk_mq_queue_map *map = &set->map[i];
+
+        switch (i) {
+        case HCTX_TYPE_DEFAULT:
+            map->nr_queues = set->nr_hw_queues - dev->poll_queues;
+            break;
+        case HCTX_TYPE_POLL:
+            map->nr_queues = dev->poll_queues;
+            break;
+        default:
+            map->nr_queues = 0;
+            continue;
+        }
+
+        map->queue_offset = offset;
+        offset += map->nr_queues;
+        blk_mq_map_queues(map);
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
+    return 0;
+#endif
+}
+
+static int blkram_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+                            unsigned int hctx_idx)
+{
+    struct blkram_queue *bq;
+
+    bq = kzalloc_node(sizeof(*bq), GFP_KERNEL, hctx->numa_node);
+    if (!bq)
+        return -ENOMEM;
+
+    spin_lock_init(&bq->poll_lock);
+    INIT_LIST_HEAD(&bq->poll_list);
+    hctx->driver_data = bq;
+
+    return 0;
+}
+
+static void blkram_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+    kfree(hctx->driver_data);
+}
+
+static const struct blk_mq_ops blkram_mq_ops = {
+    .queue_rq = blkram_queue_rq,
+    .complete = blkram_complete_rq,
+    .init_request = blkram_init_request,
+    .poll = blkram_poll,
+    .map_queues = blkram_map_queues,
+    .init_hctx = blkram_init_hctx,
+    .exit_hctx = blkram_exit_hctx,
+};
+
+/* The bio-based fast path: no tags, no request allocation, no dispatch. The
+ * bio is serviced in the submitter's context straight from its segments.
+ */
+static void blkram_handle_bio(struct bio *bio)
+{
+/* bio->bi_bdev replaced bio->bi_disk in 5.12. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    struct blkram_dev *dev = bio->bi_bdev->bd_disk->private_data;
+#else
+    struct blkram_dev *dev = bio->bi_disk->private_data;
+#endif
+    struct bvec_iter iter;
+    struct bio_vec bvec;
+    unsigned int segments = 0;
+    u64 pos, len;
+    int err = 0;
+
+    /* Nothing splits bios for a bio-based driver, so apply the queue limits
+     * here so both modes see the same I/O sizes. What does not fit is
+     * split off and resubmitted; NULL means the bio was failed instead.
+     */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+    bio = bio_split_to_limits(bio);
+    if (!bio)
+        return;
+#else
+    blk_queue_split(&bio);
+#endif
+
+    pos = (u64)bio->bi_iter.bi_sector << SECTOR_SHIFT;
+    len = bio->bi_iter.bi_size;
+
+    if (pos + len > dev->size) {
+        bio_io_error(bio);
+        return;
+    }
+    blkram_wait_loaded(dev, pos, len);
+
+    /* Only errors are injected here: a bio has no per-I/O space for a
+     * timer, and delays are a blk-mq feature.
+     */
+    if (blkram_inject_error(dev, bio_op(bio))) {
+        err = -EIO;
+        goto out;
+    }
+
+    /* A bio-based driver sees REQ_PREFLUSH itself: flush the cache before
+     * the bio's own data, if it has any.
+     */
+    if ((bio->bi_opf & REQ_PREFLUSH) && dev->cache_limit) {
+        err = blkram_cache_flush(dev);
+        if (err)
+            goto out;
+    }
+
+    switch (bio_op(bio)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        bio_for_each_segment(bvec, bio, iter)
+        {
+            err = blkram_do_bvec(dev, &bvec, pos, op_is_write(bio_op(bio)),
+                                 bio->bi_opf & REQ_FUA);
+            if (err)
+                break;
+            pos += bvec.bv_len;
+            segments++;
+        }
+        break;
+    case REQ_OP_DISCARD:
+        err = blkram_zero_range(dev, pos, len, true);
+        break;
+    case REQ_OP_WRITE_ZEROES:
+        err = blkram_zero_range(dev, pos, len, !(bio->bi_opf & REQ_NOUNMAP));
+        break;
+    default:
+        err = -EOPNOTSUPP;
+        break;
+    }
+
+out:
+    blkram_stat_add(dev, bio_op(bio), len, segments, 0, err);
+    bio->bi_status = errno_to_blk_status(err);
+    bio_endio(bio);
+}
+
+/* ->submit_bio() returns void since 5.16; earlier kernels return blk_qc_t. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void blkram_submit_bio(struct bio *bio)
+{
+    blkram_handle_bio(bio);
+}
+#else
+static blk_qc_t blkram_submit_bio(struct bio *bio)
+{
+    blkram_handle_bio(bio);
+    return BLK_QC_T_NONE;
+}
+#endif
+
+static bool blkram_loading(struct blkram_dev *dev)
+{
+    return smp_load_acquire(&dev->load_next) < dev->size >> PAGE_SHIFT;
+}
+
+/* Snapshots. Switching maps happens with the queue frozen, so no I/O is in
+ * flight and none sees the maps change under it. blk_mq_freeze_queue()
+ * returns memalloc flags to hand back to blk_mq_unfreeze_queue() since 6.14.
+ */
+static unsigned int blkram_freeze(struct blkram_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+    return blk_mq_freeze_queue(dev->queue);
+#else
+    blk_mq_freeze_queue(dev->queue);
+    return 0;
+#endif
+}
+
+static void blkram_unfreeze(struct blkram_dev *dev, unsigned int memflags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+    blk_mq_unfreeze_queue(dev->queue, memflags);
+#else
+    blk_mq_unfreeze_queue(dev->queue);
+#endif
+}
+
+/* Freeze the current map. Cached writes are flushed first so that the
+ * snapshot holds everything written before it.
+ */
+static int blkram_snapshot_create(struct blkram_dev *dev)
+{
+    int err = 0;
+
+    if (dev->snap)
+        return -EBUSY;
+    if (dev->cache_limit)
+        err = blkram_cache_flush(dev);
+    if (err)
+        return err;
+
+    dev->snap = dev->pages;
+    dev->pages = &dev->maps[dev->snap == &dev->maps[0]];
+
+    return 0;
+}
+
+/* Go back to the snapshot, which stays in place: O(pages changed). */
+static int blkram_snapshot_rollback(struct blkram_dev *dev)
+{
+    unsigned long idx;
+    void *entry, *old;
+
+    if (!dev->snap)
+        return -ENOENT;
+    if (dev->cache_limit)
+        blkram_cache_power_loss(dev);
+
+    xa_for_each(dev->pages, idx, entry)
+    {
+        old = xa_erase(dev->pages, idx);
+        if (old)
+            blkram_free_entry(dev, old);
+    }
+
+    return 0;
+}
+
+/* Keep the current contents and drop the snapshot, by folding the changes
+ * into it: O(pages changed) as well. If that runs out of memory half way,
+ * what was moved is already in the snapshot map and reads see the same
+ * data, so it can simply be retried.
+ */
+static int blkram_snapshot_delete(struct blkram_dev *dev)
+{
+    void *zero = xa_mk_value(0);
+    unsigned long idx;
+    void *entry, *old;
+
+    if (!dev->snap)
+        return -ENOENT;
+
+    xa_for_each(dev->pages, idx, entry)
+    {
+        if (entry == zero) {
+            old = xa_erase(dev->snap, idx);
+        } else {
+            old = xa_store(dev->snap, idx, entry, GFP_NOIO);
+            if (xa_is_err(old))
+                return xa_err(old);
+        }
+        if (old)
+            blkram_free_entry(dev, old);
+        /* A zero entry is only accounted; a moved entry now lives on in
+         * the snapshot map and must not be freed here.
+         */
+        if (xa_erase(dev->pages, idx) == zero)
+            blkram_free_entry(dev, zero);
+    }
+
+    dev->pages = dev->snap;
+    dev->snap = NULL;
+
+    return 0;
+}
+
+static ssize_t snapshot_show(struct device *d, struct device_attribute *attr,
+                             char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    unsigned long idx, changed = 0;
+    bool active;
+    void *entry;
+
+    mutex_lock(&dev->snap_lock);
+    active = dev->snap;
+    if (active) {
+        xa_for_each(dev->pages, idx, entry)
+        {
+            changed++;
+        }
+    }
+    mutex_unlock(&dev->snap_lock);
+
+    if (!active)
+        return sysfs_emit(buf, "none\n");
+    return sysfs_emit(buf, "active, %lu pages changed\n", changed);
+}
+
+/* "create", "rollback" or "delete". */
+static ssize_t snapshot_store(struct device *d, struct device_attribute *attr,
+                              const char *buf, size_t count)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    unsigned int memflags;
+    int err;
+
+    /* Zone write pointers are not part of a snapshot, and stores through a
+     * DAX mapping would go straight into the frozen pages.
+     */
+    if (dev->zones || dev->dax)
+        return -EOPNOTSUPP;
+    /* The loader writes to the live map behind the frozen queue's back. */
+    if (blkram_loading(dev))
+        return -EBUSY;
+
+    mutex_lock(&dev->snap_lock);
+    /* The snapshot is the save's until it is done with it. */
+    if (dev->saving) {
+        mutex_unlock(&dev->snap_lock);
+        return -EBUSY;
+    }
+    memflags = blkram_freeze(dev);
+    if (sysfs_streq(buf, "create"))
+        err = blkram_snapshot_create(dev);
+    else if (sysfs_streq(buf, "rollback"))
+        err = blkram_snapshot_rollback(dev);
+    else if (sysfs_streq(buf, "delete"))
+        err = blkram_snapshot_delete(dev);
+    else
+        err = -EINVAL;
+    blkram_unfreeze(dev, memflags);
+    mutex_unlock(&dev->snap_lock);
+
+    return err ? err : count;
+}
+static DEVICE_ATTR_RW(snapshot);
+
+/* Backing file. The image is loaded by a worker in large sequential reads
+ * while the disk is already up: pages of zeroes are skipped, so a sparse
+ * image stays sparse in memory, and blkram_wait_loaded() holds back I/O
+ * ahead of the loader. The page cache copy of each chunk is dropped once
+ * it is stored, so the image does not sit in memory twice.
+ */
+static void blkram_load_work(struct work_struct *work)
+{
+    struct blkram_dev *dev = container_of(work, struct blkram_dev, load_work);
+    pgoff_t nr_pages = dev->size >> PAGE_SHIFT;
+    struct file *file = dev->load_file;
+    loff_t pos = 0;
+    ssize_t ret = 0;
+    void *buf;
+
+    buf = vmalloc(BLKRAM_BACKING_CHUNK);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    vfs_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (pos < dev->size && !READ_ONCE(dev->load_stop)) {
+        size_t chunk = min_t(u64, BLKRAM_BACKING_CHUNK, dev->size - pos);
+        loff_t fpos = pos;
+        size_t off;
+
+        ret = kernel_read(file, buf, chunk, &fpos);
+        if (ret <= 0)
+            break;
+        /* A short read is the end of the image; the rest reads as zeroes. */
+        if (ret < chunk) {
+            memset(buf + ret, 0, PAGE_ALIGN(ret) - ret);
+            chunk = PAGE_ALIGN(ret);
+        }
+
+        for (off = 0; off < chunk; off += PAGE_SIZE) {
+            if (!memchr_inv(buf + off, 0, PAGE_SIZE))
+                continue;
+            ret = blkram_store_rw(dev, (pos + off) >> PAGE_SHIFT, 0,
+                                  PAGE_SIZE, vmalloc_to_page(buf + off), 0,
+                                  true);
+            if (ret)
+                goto out;
+        }
+        vfs_fadvise(file, pos, chunk, POSIX_FADV_DONTNEED);
+
+        pos += chunk;
+        smp_store_release(&dev->load_next, pos >> PAGE_SHIFT);
+        wake_up_all(&dev->load_wq);
+        if (chunk < BLKRAM_BACKING_CHUNK)
+            break;
+        cond_resched();
+    }
+
+out:
+    vfree(buf);
+    filp_close(file, NULL);
+    dev->load_err = ret < 0 ? ret : 0;
+    if (ret < 0)
+        pr_err("blkram: loading %s into blkram%d failed (%zd)\n",
+               dev->backing_file, dev->id, ret);
+    /* Whatever was not loaded reads as zeroes from now on. */
+    smp_store_release(&dev->load_next, nr_pages);
+    wake_up_all(&dev->load_wq);
+}
+
+/* A missing image is not an error: the disk starts out empty and the first
+ * save creates the file.
+ */
+static int blkram_start_load(struct blkram_dev *dev)
+{
+    struct file *file;
+
+    file = filp_open(dev->backing_file, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file) == -ENOENT ? 0 : PTR_ERR(file);
+
+    dev->load_file = file;
+    dev->load_next = 0;
+    queue_work(system_unbound_wq, &dev->load_work);
+
+    return 0;
+}
+
+static void blkram_stop_load(struct blkram_dev *dev)
+{
+    WRITE_ONCE(dev->load_stop, true);
+    flush_work(&dev->load_work);
+}
+
+/* Copy page @idx of @map into @buf. The save worker reads the frozen map
+ * of its snapshot this way, so nothing it sees changes under it.
+ */
+static int blkram_read_map(struct blkram_dev *dev, struct xarray *map,
+                           pgoff_t idx, void *buf)
+{
+    void *entry;
+    int err = 0;
+
+    rcu_read_lock();
+    entry = xa_load(map, idx);
+    if (dev->compress) {
+        err = blkram_zload(dev, entry, buf);
+    } else if (!entry) {
+        memset(buf, 0, PAGE_SIZE);
+    } else if (xa_is_value(entry)) {
+        blkram_fill(buf, entry, PAGE_SIZE);
+    } else {
+        void *mem = blkram_kmap(entry);
+
+        memcpy(buf, mem, PAGE_SIZE);
+        blkram_kunmap(mem);
+    }
+    rcu_read_unlock();
+
+    return err;
+}
+
+/* Write the disk to the backing file in large sequential writes. This runs
+ * from a worker and reads the snapshot taken when the save was started, so
+ * I/O to the disk carries on while the file is written and synced. DAX disks
+ * cannot have a snapshot and are copied as they are, stores through a
+ * mapping and all.
+ */
+static void blkram_save_work(struct work_struct *work)
+{
+    struct blkram_dev *dev = container_of(work, struct blkram_dev, save_work);
+    struct xarray *map = dev->snap ? dev->snap : dev->pages;
+    struct file *file = dev->save_file;
+    unsigned int memflags;
+    loff_t pos = 0;
+    ssize_t ret;
+    void *buf;
+    int err = 0;
+
+    buf = vmalloc(BLKRAM_BACKING_CHUNK);
+    if (!buf) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    while (pos < dev->size) {
+        size_t chunk = min_t(u64, BLKRAM_BACKING_CHUNK, dev->size - pos);
+        loff_t fpos = pos;
+        size_t off;
+
+        if (READ_ONCE(dev->save_stop)) {
+            err = -EINTR;
+            goto out;
+        }
+
+        for (off = 0; off < chunk; off += PAGE_SIZE) {
+            err = blkram_read_map(dev, map, (pos + off) >> PAGE_SHIFT,
+                                  buf + off);
+            if (err)
+                goto out;
+        }
+
+        ret = kernel_write(file, buf, chunk, &fpos);
+        if (ret != chunk) {
+            err = ret < 0 ? ret : -EIO;
+            goto out;
+        }
+        pos += chunk;
+        WRITE_ONCE(dev->save_next, pos >> PAGE_SHIFT);
+        cond_resched();
+    }
+
+    /* A longer image, say from before the disk was recreated smaller, must
+     * not keep its old tail for a later, larger disk to load.
+     */
+    err = vfs_truncate(&file->f_path, dev->size);
+    if (!err)
+        err = vfs_fsync(file, 0);
+    if (!err)
+        vfs_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+
+out:
+    vfree(buf);
+    filp_close(file, NULL);
+    if (err)
+        pr_err("blkram%d: saving to %s failed: %d\n", dev->id,
+               dev->backing_file, err);
+
+    mutex_lock(&dev->snap_lock);
+    /* Fold the writes made during the save back in. Deleting only runs out
+     * of memory between entries and picks up where it stopped, so keep at
+     * it rather than leave the disk with a snapshot nobody asked for.
+     */
+    while (dev->snap) {
+        memflags = blkram_freeze(dev);
+        blkram_snapshot_delete(dev);
+        blkram_unfreeze(dev, memflags);
+        if (dev->snap)
+            msleep(10);
+    }
+    dev->save_err = err;
+    dev->saving = false;
+    mutex_unlock(&dev->snap_lock);
+}
+
+/* Called with snap_lock held. */
+static int blkram_start_save(struct blkram_dev *dev)
+{
+    unsigned int memflags;
+    struct file *file;
+    int err = 0;
+
+    if (dev->save_stop)
+        return -ENODEV;
+    /* A snapshot of the user's own would be the wrong image, and there can
+     * only be one.
+     */
+    if (dev->saving || dev->snap)
+        return -EBUSY;
+
+    /* Not O_TRUNC: the file is only cut to size once the new contents are
+     * in place.
+     */
+    file = filp_open(dev->backing_file, O_WRONLY | O_CREAT | O_LARGEFILE,
+                     0600);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    /* Freezing only for as long as it takes to flush the write cache and
+     * swap the maps.
+     */
+    if (!dev->dax) {
+        memflags = blkram_freeze(dev);
+        err = blkram_snapshot_create(dev);
+        blkram_unfreeze(dev, memflags);
+    }
+    if (err) {
+        filp_close(file, NULL);
+        return err;
+    }
+
+    dev->save_file = file;
+    dev->save_next = 0;
+    dev->save_err = 0;
+    dev->saving = true;
+    queue_work(system_unbound_wq, &dev->save_work);
+    return 0;
+}
+
+/* Taking snap_lock orders this against blkram_start_save(), so no save can
+ * be queued after the flush.
+ */
+static void blkram_stop_save(struct blkram_dev *dev)
+{
+    mutex_lock(&dev->snap_lock);
+    dev->save_stop = true;
+    mutex_unlock(&dev->snap_lock);
+    flush_work(&dev->save_work);
+}
+
+static ssize_t backing_show(struct device *d, struct device_attribute *attr,
+                            char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    ssize_t ret;
+
+    if (!dev->backing_file)
+        return sysfs_emit(buf, "none\n");
+    if (blkram_loading(dev))
+        return sysfs_emit(buf, "%s: loading, %lu of %llu pages\n",
+                          dev->backing_file,
+                          smp_load_acquire(&dev->load_next),
+                          dev->size >> PAGE_SHIFT);
+    if (dev->load_err)
+        return sysfs_emit(buf, "%s: load failed (%d)\n", dev->backing_file,
+                          dev->load_err);
+
+    mutex_lock(&dev->snap_lock);
+    if (dev->saving)
+        ret = sysfs_emit(buf, "%s: saving, %lu of %llu pages\n",
+                         dev->backing_file, READ_ONCE(dev->save_next),
+                         dev->size >> PAGE_SHIFT);
+    else if (dev->save_err)
+        ret = sysfs_emit(buf, "%s: save failed (%d)\n", dev->backing_file,
+                         dev->save_err);
+    else
+        ret = sysfs_emit(buf, "%s: loaded\n", dev->backing_file);
+    mutex_unlock(&dev->snap_lock);
+
+    return ret;
+}
+
+/* "save" starts writing the disk back to its backing file. Progress and the
+ * outcome show up here on read.
+ */
+static ssize_t backing_store(struct device *d, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    int err;
+
+    if (!sysfs_streq(buf, "save"))
+        return -EINVAL;
+    if (!dev->backing_file)
+        return -ENOENT;
+    /* Saving a half-loaded disk would truncate the image's contents. */
+    if (blkram_loading(dev))
+        return -EBUSY;
+
+    mutex_lock(&dev->snap_lock);
+    err = blkram_start_save(dev);
+    mutex_unlock(&dev->snap_lock);
+
+    return err ? err : count;
+}
+static DEVICE_ATTR_RW(backing);
+
+/* Shrinker. Under memory pressure, pages whose content is one repeated
+ * 32-bit word (most often zeroes: mkfs, write-zeroes with REQ_NOUNMAP,
+ * partial overwrites) are replaced by value entries and freed. The
+ * compressed store already does this on every write.
+ *
+ * Raw writers copy into a page under RCU without any lock, so a scan marks
+ * its candidates, waits for a grace period so that every copy which missed
+ * the mark has finished, and only then checks each page again and swaps
+ * it. Writers that find the mark wait for the scan on dev->shrink_wq.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct blkram_dev *blkram_shrinker_dev(struct shrinker *s)
+{
+    return s->private_data;
+}
+#else
+static struct blkram_dev *blkram_shrinker_dev(struct shrinker *s)
+{
+    return container_of(s, struct blkram_dev, shrinker);
+}
+#endif
+
+/* Called under RCU. */
+static bool blkram_page_same_filled(struct page *page, u32 *pattern)
+{
+    void *mem = blkram_kmap(page);
+    bool same = blkram_same_filled(mem, pattern);
+
+    blkram_kunmap(mem);
+    return same;
+}
+
+/* Every backing page is a candidate; the scan finds out which pay off. */
+static unsigned long blkram_shrink_count(struct shrinker *s,
+                                         struct shrink_control *sc)
+{
+    struct blkram_dev *dev = blkram_shrinker_dev(s);
+    unsigned long pages = 0;
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY)
+    {
+        pages += atomic_long_read(&dev->node_pages[nid]);
+    }
+
+    return pages ?: SHRINK_EMPTY;
+}
+
+static unsigned long blkram_shrink_scan(struct shrinker *s,
+                                        struct shrink_control *sc)
+{
+    struct blkram_dev *dev = blkram_shrinker_dev(s);
+    unsigned long idx, scanned = 0, marked = 0, freed = 0;
+    struct page *page;
+    u32 pattern;
+
+    /* Snapshot operations move entries between maps, and the loader is
+     * still filling the store; neither is worth waiting for in reclaim.
+     */
+    if (!mutex_trylock(&dev->snap_lock))
+        return SHRINK_STOP;
+    if (dev->snap || blkram_loading(dev)) {
+        mutex_unlock(&dev->snap_lock);
+        return SHRINK_STOP;
+    }
+
+    idx = dev->shrink_cursor;
+    rcu_read_lock();
+    page = xa_find(dev->pages, &idx, ULONG_MAX, XA_PRESENT);
+    while (page && scanned < sc->nr_to_scan) {
+        if (!xa_is_value(page) && blkram_page_same_filled(page, &pattern)) {
+            xa_set_mark(dev->pages, idx, BLKRAM_SHRINK_MARK);
+            marked++;
+        }
+        scanned++;
+        page = xa_find_after(dev->pages, &idx, ULONG_MAX, XA_PRESENT);
+    }
+    rcu_read_unlock();
+    /* Resume after the last page looked at, or wrap around. */
+    dev->shrink_cursor = page ? idx : 0;
+
+    if (marked) {
+        synchronize_rcu();
+
+        idx = 0;
+        rcu_read_lock();
+        page = xa_find(dev->pages, &idx, ULONG_MAX, BLKRAM_SHRINK_MARK);
+        while (page) {
+            if (blkram_page_same_filled(page, &pattern) &&
+                xa_cmpxchg(dev->pages, idx, page, xa_mk_value(pattern),
+                           GFP_NOWAIT) == page) {
+                blkram_free_page(dev, page);
+                freed++;
+            }
+            xa_clear_mark(dev->pages, idx, BLKRAM_SHRINK_MARK);
+            page = xa_find_after(dev->pages, &idx, ULONG_MAX,
+                                 BLKRAM_SHRINK_MARK);
+        }
+        rcu_read_unlock();
+        wake_up_all(&dev->shrink_wq);
+    }
+    mutex_unlock(&dev->snap_lock);
+
+    atomic64_add(scanned, &dev->shrink_scanned);
+    atomic64_add(freed, &dev->shrink_reclaimed);
+
+    return freed;
+}
+
+/* The shrinker API changed twice: 6.0 added a name for debugfs, and 6.7
+ * made shrinkers dynamically allocated.
+ */
+static int blkram_init_shrinker(struct blkram_dev *dev)
+{
+    struct shrinker *s;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    s = shrinker_alloc(0, "blkram-%d", dev->id);
+    if (!s)
+        return -ENOMEM;
+    s->private_data = dev;
+    dev->shrinker = s;
+#else
+    s = &dev->shrinker;
+#endif
+    s->count_objects = blkram_shrink_count;
+    s->scan_objects = blkram_shrink_scan;
+    s->seeks = DEFAULT_SEEKS;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_register(s);
+    return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(s, "blkram-%d", dev->id);
+#else
+    return register_shrinker(s);
+#endif
+}
+
+/* Waits for a scan in progress. */
+static void blkram_free_shrinker(struct blkram_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(dev->shrinker);
+#else
+    unregister_shrinker(&dev->shrinker);
+#endif
+}
+
+static ssize_t shrink_stat_show(struct device *d,
+                                struct device_attribute *attr, char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+
+    if (!dev->shrink)
+        return sysfs_emit(buf, "disabled\n");
+
+    return sysfs_emit(buf, "scanned %lld\nreclaimed %lld\n",
+                      (long long)atomic64_read(&dev->shrink_scanned),
+                      (long long)atomic64_read(&dev->shrink_reclaimed));
+}
+static DEVICE_ATTR_RO(shrink_stat);
+
+/* One "<op>_<counter> value" line each, summed over all CPUs. */
+static ssize_t io_stat_show(struct device *d, struct device_attribute *attr,
+                            char *buf)
+{
+    static const char *const names[] = { "read", "write", "other" };
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    struct blkram_stat sum = {};
+    int cpu, i, len = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct blkram_stat *st = per_cpu_ptr(dev->stat, cpu);
+
+        for (i = 0; i < BLKRAM_LAT_OPS; i++) {
+            sum.ios[i] += st->ios[i];
+            sum.bytes[i] += st->bytes[i];
+            sum.segments[i] += st->segments[i];
+            sum.merges[i] += st->merges[i];
+            sum.errors[i] += st->errors[i];
+        }
+    }
+
+    for (i = 0; i < BLKRAM_LAT_OPS; i++)
+        len += sysfs_emit_at(buf, len,
+                             "%s_ios %llu\n%s_bytes %llu\n%s_segments %llu\n"
+                             "%s_merges %llu\n%s_errors %llu\n",
+                             names[i], sum.ios[i], names[i], sum.bytes[i],
+                             names[i], sum.segments[i], names[i],
+                             sum.merges[i], names[i], sum.errors[i]);
+
+    return len;
+}
+static DEVICE_ATTR_RO(io_stat);
+
+/* Increments and decrements land on whichever CPU ran the submission and
+ * the completion, so only the sum over all CPUs is meaningful: the number
+ * of requests queued to a worker but not completed yet, the emulated
+ * device's queue depth. It is the only value reported.
+ */
+static ssize_t async_inflight_show(struct device *d,
+                                   struct device_attribute *attr, char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    long inflight = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        inflight += *per_cpu_ptr(dev->async_inflight, cpu);
+    }
+
+    return sysfs_emit(buf, "%ld\n", max(inflight, 0L));
+}
+static DEVICE_ATTR_RO(async_inflight);
+
+/* One "nodeN pages" line per node with memory, to check page placement. */
+static ssize_t numa_pages_show(struct device *d, struct device_attribute *attr,
+                               char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    int len = 0;
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY)
+    {
+        len += sysfs_emit_at(buf, len, "node%d %ld\n", nid,
+                             atomic_long_read(&dev->node_pages[nid]));
+    }
+
+    return len;
+}
+static DEVICE_ATTR_RO(numa_pages);
+
+/* Compression ratio is pages * PAGE_SIZE / mem_used_bytes; the CPU cost is
+ * the *_ns totals over the matching call counts.
+ */
+static ssize_t compress_stat_show(struct device *d,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+    struct blkram_zstat sum = {};
+    int cpu;
+
+    if (!dev->compress)
+        return sysfs_emit(buf, "disabled\n");
+
+    for_each_possible_cpu(cpu)
+    {
+        struct blkram_zstat *zs = per_cpu_ptr(dev->zstat, cpu);
+
+        sum.comp_calls += zs->comp_calls;
+        sum.comp_ns += zs->comp_ns;
+        sum.decomp_calls += zs->decomp_calls;
+        sum.decomp_ns += zs->decomp_ns;
+    }
+
+    return sysfs_emit(buf,
+                      "pages %ld\nsame_filled %ld\nincompressible %ld\n"
+                      "mem_used_bytes %lld\ncompress_calls %llu\n"
+                      "compress_ns %llu\ndecompress_calls %llu\n"
+                      "decompress_ns %llu\n",
+                      atomic_long_read(&dev->z_pages),
+                      atomic_long_read(&dev->z_same),
+                      atomic_long_read(&dev->z_huge),
+                      (long long)atomic64_read(&dev->z_bytes), sum.comp_calls,
+                      sum.comp_ns, sum.decomp_calls, sum.decomp_ns);
+}
+static DEVICE_ATTR_RO(compress_stat);
+
+/* flush_ns / flushes is the average cost of a flush. */
+static ssize_t cache_stat_show(struct device *d, struct device_attribute *attr,
+                               char *buf)
+{
+    struct blkram_dev *dev = dev_to_disk(d)->private_data;
+
+    if (!dev->cache_limit)
+        return sysfs_emit(buf, "disabled\n");
+
+    return sysfs_emit(buf, "dirty_pages %ld\nflushes %lld\nflush_ns %lld\n",
+                      atomic_long_read(&dev->cache_pages),
+                      (long long)atomic64_read(&dev->flushes),
+                      (long long)atomic64_read(&dev->flush_ns));
+}
+static DEVICE_ATTR_RO(cache_stat);
+
+static struct attribute *blkram_attrs[] = {
+    &dev_attr_async_inflight.attr,
+    &dev_attr_numa_pages.attr,
+    &dev_attr_compress_stat.attr,
+    &dev_attr_cache_stat.attr,
+    &dev_attr_snapshot.attr,
+    &dev_attr_backing.attr,
+    &dev_attr_shrink_stat.attr,
+    &dev_attr_io_stat.attr,
+    NULL,
+};
+
+/* Shows up as /sys/block/blkram0/blkram/. */
+static const struct attribute_group blkram_attr_group = {
+    .name = "blkram",
+    .attrs = blkram_attrs,
+};
+
+static const struct attribute_group *blkram_attr_groups[] = {
+    &blkram_attr_group,
+    NULL,
+};
+
+static const char *const blkram_lat_stage_names[] = { "q2s", "copy", "total" };
+static const char *const blkram_lat_op_names[] = { "read", "write", "other" };
+static const char *const blkram_lat_size_names[] = { "4k", "64k", "512k",
+                                                     "larger" };
+
+/* One line per stage, op and size class that has samples, e.g.
+ *   copy write 4k 1024:12 2048:40711 4096:310
+ * where each pair is a bucket's lower bound in ns and its count. The copies
+ * are summed without stopping I/O, so a line may be a few samples stale.
+ */
+static int blkram_lat_show(struct seq_file *m, void *v)
+{
+    struct blkram_dev *dev = m->private;
+    u64 sum[BLKRAM_LAT_BUCKETS];
+    int stage, op, size, b, cpu;
+
+    for (stage = 0; stage < BLKRAM_LAT_STAGES; stage++) {
+        for (op = 0; op < BLKRAM_LAT_OPS; op++) {
+            for (size = 0; size < BLKRAM_LAT_SIZES; size++) {
+                bool any = false;
+
+                memset(sum, 0, sizeof(sum));
+                for_each_possible_cpu(cpu)
+                {
+                    struct blkram_lat *lat = per_cpu_ptr(dev->lat, cpu);
+
+                    for (b = 0; b < BLKRAM_LAT_BUCKETS; b++) {
+                        sum[b] += lat->hist[stage][op][size][b];
+                        any |= sum[b] != 0;
+                    }
+                }
+                if (!any)
+                    continue;
+
+                seq_printf(m, "%s %s %s", blkram_lat_stage_names[stage],
+                           blkram_lat_op_names[op],
+                           blkram_lat_size_names[size]);
+                for (b = 0; b < BLKRAM_LAT_BUCKETS; b++) {
+                    if (sum[b])
+                        seq_printf(m, " %llu:%llu", b ? 1ULL << b : 0ULL,
+                                   sum[b]);
+                }
+                seq_putc(m, '\n');
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int blkram_lat_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, blkram_lat_show, inode->i_private);
+}
+
+/* Any write clears the histograms. Samples recorded while the clearing runs
+ * may be lost, which is fine for statistics and keeps the I/O path free of
+ * locks.
+ */
+static ssize_t blkram_lat_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos)
+{
+    struct blkram_dev *dev = file_inode(file)->i_private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(dev->lat, cpu), 0, sizeof(struct blkram_lat));
+    }
+
+    return count;
+}
+
+static const struct file_operations blkram_lat_fops = {
+    .owner = THIS_MODULE,
+    .open = blkram_lat_open,
+    .read = seq_read,
+    .write = blkram_lat_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t blkram_lat_enable_read(struct file *file, char __user *buf,
+                                      size_t count, loff_t *ppos)
+{
+    char val[2] = { static_key_enabled(&blkram_lat_enabled) ? '1' : '0',
+                    '\n' };
+
+    return simple_read_from_buffer(buf, count, ppos, val, sizeof(val));
+}
+
+static ssize_t blkram_lat_enable_write(struct file *file,
+                                       const char __user *buf, size_t count,
+                                       loff_t *ppos)
+{
+    bool enable;
+    int ret;
+
+    ret = kstrtobool_from_user(buf, count, &enable);
+    if (ret)
+        return ret;
+
+    if (enable)
+        static_branch_enable(&blkram_lat_enabled);
+    else
+        static_branch_disable(&blkram_lat_enabled);
+
+    return count;
+}
+
+static const struct file_operations blkram_lat_enable_fops = {
+    .owner = THIS_MODULE,
+    .read = blkram_lat_enable_read,
+    .write = blkram_lat_enable_write,
+    .llseek = default_llseek,
+};
+
+/* Any write drops the unflushed contents of the write cache. */
+static ssize_t blkram_power_loss_write(struct file *file,
+                                       const char __user *buf, size_t count,
+                                       loff_t *ppos)
+{
+    struct blkram_dev *dev = file_inode(file)->i_private;
+
+    blkram_cache_power_loss(dev);
+    pr_info("blkram: power loss, unflushed writes dropped\n");
+
+    return count;
+}
+
+static const struct file_operations blkram_power_loss_fops = {
+    .owner = THIS_MODULE,
+    .write = blkram_power_loss_write,
+    .llseek = noop_llseek,
+};
+
+/* /sys/kernel/debug/blkram/<disk>/. As usual for debugfs, failures are not
+ * checked: the disk works without these files.
+ */
+static void blkram_debugfs_init(struct blkram_dev *dev)
+{
+    struct blkram_inject *inj = &dev->inject;
+    struct dentry *dir;
+
+    dev->debugfs = debugfs_create_dir(dev->disk->disk_name, blkram_debugfs);
+    if (!dev->bio)
+        debugfs_create_file("latency", 0600, dev->debugfs, dev,
+                            &blkram_lat_fops);
+    if (dev->cache_limit)
+        debugfs_create_file("power_loss", 0200, dev->debugfs, dev,
+                            &blkram_power_loss_fops);
+
+    dir = debugfs_create_dir("inject", dev->debugfs);
+    debugfs_create_u32("read_error_ppm", 0600, dir,
+                       &inj->error_ppm[BLKRAM_LAT_READ]);
+    debugfs_create_u32("write_error_ppm", 0600, dir,
+                       &inj->error_ppm[BLKRAM_LAT_WRITE]);
+    debugfs_create_u32("other_error_ppm", 0600, dir,
+                       &inj->error_ppm[BLKRAM_LAT_OTHER]);
+    if (dev->bio)
+        return;
+    debugfs_create_u32("delay_mode", 0600, dir, &inj->delay_mode);
+    debugfs_create_u64("delay_ns", 0600, dir, &inj->delay_ns);
+    debugfs_create_u64("delay_max_ns", 0600, dir, &inj->delay_max_ns);
+    debugfs_create_u64("tail_ns", 0600, dir, &inj->tail_ns);
+    debugfs_create_u32("tail_ppm", 0600, dir, &inj->tail_ppm);
+}
+
+/* A disk is bio-based exactly when its fops provide ->submit_bio(), so the
+ * two modes need separate operation tables.
+ */
+static const struct block_device_operations blkram_fops = {
+    .owner = THIS_MODULE,
+#if BLKRAM_HAVE_ZONED
+    .report_zones = blkram_report_zones,
+#endif
+};
+
+static const struct block_device_operations blkram_bio_fops = {
+    .owner = THIS_MODULE,
+    .submit_bio = blkram_submit_bio,
+};
+
+static int blkram_init_tag_set(struct blkram_dev *dev,
+                               const struct blkram_config *cfg)
+{
+    struct blk_mq_tag_set *set = &dev->tag_set;
+
+    set->ops = &blkram_mq_ops;
+    /* With one hardware queue per CPU every submitter owns its own tags, so
+     * there is no shared tag bitmap to fight over. blk-mq also picks the
+     * "none" scheduler by default once there is more than one queue.
+     */
+    set->nr_hw_queues = cfg->hw_queues ? cfg->hw_queues : num_online_cpus();
+    set->queue_depth = cfg->queue_depth;
+    /* With NUMA_NO_NODE, blk-mq allocates each hctx, its tags and its
+     * requests on the node of the CPUs mapped to it, which keeps them local
+     * to their submitters. Binding the store pins them to its node instead.
+     */
+    set->numa_node = dev->numa_node;
+    set->cmd_size = sizeof(struct blkram_cmd);
+
+    /* Poll queues sit after the default ones and get their own map, which
+     * is also what makes blk-mq flag the queue as pollable.
+     */
+    if (dev->poll_queues) {
+        set->nr_hw_queues += dev->poll_queues;
+        set->nr_maps = HCTX_MAX_TYPES;
+    } else {
+        set->nr_maps = 1;
+    }
+    /* BLK_MQ_F_SHOULD_MERGE was removed in 6.6+; merging is always on.
+     * BLK_MQ_F_BLOCKING lets ->queue_rq() sleep while allocating a page on
+     * the first write to it.
+     */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+    set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+#else
+    set->flags = BLK_MQ_F_BLOCKING;
+#endif
+    set->driver_data = dev;
+
+    return blk_mq_alloc_tag_set(set);
+}
+
+static int blkram_init_numa(struct blkram_dev *dev)
+{
+    int nid;
+
+    dev->node_pages =
+        kcalloc(nr_node_ids, sizeof(*dev->node_pages), GFP_KERNEL);
+    dev->mem_nodes = kcalloc(nr_node_ids, sizeof(*dev->mem_nodes), GFP_KERNEL);
+    if (!dev->node_pages || !dev->mem_nodes) {
+        kfree(dev->node_pages);
+        kfree(dev->mem_nodes);
+        return -ENOMEM;
+    }
+
+    for_each_node_state(nid, N_MEMORY)
+    {
+        dev->mem_nodes[dev->nr_mem_nodes++] = nid;
+    }
+
+    return 0;
+}
+
+static void blkram_free_numa(struct blkram_dev *dev)
+{
+    kfree(dev->mem_nodes);
+    kfree(dev->node_pages);
+}
+
+static int blkram_init_cache(struct blkram_dev *dev, unsigned long cache_mb)
+{
+    unsigned int i;
+
+    dev->cache_limit = cache_mb << (20 - PAGE_SHIFT);
+    xa_init(&dev->cache);
+    dev->nr_cache_locks = roundup_pow_of_two(num_possible_cpus());
+    dev->cache_locks =
+        kcalloc(dev->nr_cache_locks, sizeof(*dev->cache_locks), GFP_KERNEL);
+    if (!dev->cache_locks)
+        return -ENOMEM;
+
+    for (i = 0; i < dev->nr_cache_locks; i++)
+        mutex_init(&dev->cache_locks[i]);
+
+    return 0;
+}
+
+/* Unflushed data is simply lost on unload, as on any volatile cache. */
+static void blkram_free_cache(struct blkram_dev *dev)
+{
+    struct page *cpage;
+    unsigned long idx;
+
+    xa_for_each(&dev->cache, idx, cpage)
+    {
+        __free_page(cpage);
+    }
+    xa_destroy(&dev->cache);
+    kfree(dev->cache_locks);
+}
+
+/* Lay out the zones: @zone_nr_conv conventional ones first, then sequential
+ * zones, all empty.
+ */
+static int blkram_init_zones(struct blkram_dev *dev,
+                             const struct blkram_config *cfg)
+{
+    unsigned int i;
+
+    dev->zone_sectors = (sector_t)cfg->zone_size_mb << (20 - SECTOR_SHIFT);
+    dev->nr_zones = cfg->zone_nr ?: cfg->mb / cfg->zone_size_mb;
+    dev->size = (u64)dev->nr_zones * cfg->zone_size_mb << 20;
+    dev->zones = kvcalloc(dev->nr_zones, sizeof(*dev->zones), GFP_KERNEL);
+    if (!dev->zones)
+        return -ENOMEM;
+
+    for (i = 0; i < dev->nr_zones; i++) {
+        struct blkram_zone *zone = &dev->zones[i];
+
+        mutex_init(&zone->lock);
+        zone->start = (sector_t)i * dev->zone_sectors;
+        zone->wp = zone->start;
+        if (i < cfg->zone_nr_conv) {
+            zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+            zone->cond = BLK_ZONE_COND_NOT_WP;
+        } else {
+            zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+            zone->cond = BLK_ZONE_COND_EMPTY;
+        }
+    }
+
+    return 0;
+}
+
+static void blkram_free_compress(struct blkram_dev *dev)
+{
+    unsigned int i;
+    int cpu;
+
+    if (dev->zbuf) {
+        for_each_possible_cpu(cpu)
+        {
+            kfree(*per_cpu_ptr(dev->zbuf, cpu));
+        }
+        free_percpu(dev->zbuf);
+    }
+    for (i = 0; dev->zstripes && i < dev->nr_zstripes; i++) {
+        kfree(dev->zstripes[i].buf);
+        kfree(dev->zstripes[i].cbuf);
+        kvfree(dev->zstripes[i].wmem);
+    }
+    kfree(dev->zstripes);
+    free_percpu(dev->zstat);
+}
+
+/* One stripe per CPU, rounded up to a power of two, gives writers on
+ * different CPUs the same odds of not contending that zram's per-CPU
+ * streams do.
+ */
+static int blkram_init_compress(struct blkram_dev *dev)
+{
+    unsigned int i;
+    int cpu;
+
+    dev->nr_zstripes = roundup_pow_of_two(num_possible_cpus());
+    dev->zstripes =
+        kcalloc(dev->nr_zstripes, sizeof(*dev->zstripes), GFP_KERNEL);
+    dev->zbuf = alloc_percpu(void *);
+    dev->zstat = alloc_percpu(struct blkram_zstat);
+    if (!dev->zstripes || !dev->zbuf || !dev->zstat)
+        goto err;
+
+    for (i = 0; i < dev->nr_zstripes; i++) {
+        struct blkram_zstripe *st = &dev->zstripes[i];
+
+        mutex_init(&st->lock);
+        st->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        st->cbuf = kmalloc(BLKRAM_ZMAX_LEN, GFP_KERNEL);
+        st->wmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (!st->buf || !st->cbuf || !st->wmem)
+            goto err;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        void *buf = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
 
-/* genhd.h was removed in 5.18; its content lives in blkdev.h since 5.17. */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
-#include <linux/genhd.h>
-#endif
+        if (!buf)
+            goto err;
+        *per_cpu_ptr(dev->zbuf, cpu) = buf;
+    }
 
-#define BLKRAM_SECTOR_SIZE 512
+    return 0;
 
-static unsigned long blkram_mb = 8;
-module_param(blkram_mb, ulong, 0444);
-MODULE_PARM_DESC(blkram_mb, "Size of the RAM disk in MiB");
+err:
+    blkram_free_compress(dev);
+    return -ENOMEM;
+}
 
-struct blkram_dev {
-    struct blk_mq_tag_set tag_set;
-    struct gendisk *disk;
-    struct request_queue *queue;
-    u8 *data;
-    size_t size;
-};
+/* Free the store once nothing can reach it any more: the disk is gone and
+ * no DAX file is open. Pages still mapped into a process live on until it
+ * unmaps them, since the mapping holds its own reference to each.
+ */
+static void blkram_dev_release(struct kref *ref)
+{
+    struct blkram_dev *dev = container_of(ref, struct blkram_dev, ref);
 
-static struct blkram_dev *blkram;
-static int blkram_major;
+    if (dev->shrink)
+        blkram_free_shrinker(dev);
+    kvfree(dev->zones);
+    if (dev->cache_limit)
+        blkram_free_cache(dev);
+    blkram_free_pages(dev);
+    /* The RCU callbacks of freed entries do not touch the stripes. */
+    if (dev->compress)
+        blkram_free_compress(dev);
+    free_percpu(dev->stat);
+    free_percpu(dev->lat);
+    free_percpu(dev->async_inflight);
+    blkram_free_numa(dev);
+    ida_free(&blkram_ida, dev->id);
+    kfree(dev->backing_file);
+    kfree(dev);
+}
 
-static blk_status_t blkram_transfer(struct blkram_dev *dev, struct request *rq)
+/* Direct load/store access in the style of device DAX: /dev/blkramN_dax
+ * maps the backing pages themselves into user space, so an access through
+ * the mapping is a plain memory access with no page cache copy and no trip
+ * through the block layer. A page is allocated by the first fault on it
+ * and stays mapped until the process unmaps it; a discard of a mapped page
+ * only takes it out of the disk.
+ */
+static vm_fault_t blkram_dax_fault(struct vm_fault *vmf)
 {
-    struct req_iterator iter;
-    struct bio_vec bvec;
-    sector_t sector = blk_rq_pos(rq);
-    unsigned long offset = (unsigned long)sector * BLKRAM_SECTOR_SIZE;
+    struct blkram_dev *dev = vmf->vma->vm_file->private_data;
+    pgoff_t idx = vmf->pgoff;
+    struct page *page;
+    int err;
 
-    rq_for_each_segment(bvec, rq, iter)
-    {
-        unsigned int len = bvec.bv_len;
-        void *iobuf;
+    blkram_wait_loaded(dev, (u64)idx << PAGE_SHIFT, PAGE_SIZE);
 
-        if (offset + len > dev->size)
-            return BLK_STS_IOERR;
+    rcu_read_lock();
+    page = xa_load(dev->pages, idx);
+    while (!page || xa_is_value(page)) {
+        rcu_read_unlock();
+        err = blkram_alloc_page(dev, idx, page);
+        if (err)
+            return VM_FAULT_OOM;
+        rcu_read_lock();
+        page = xa_load(dev->pages, idx);
+    }
+    /* A discard may free the page as soon as RCU is left. */
+    get_page(page);
+    rcu_read_unlock();
 
-/* kmap_local_page() appeared in 5.11; fall back to kmap_atomic() on 5.10. */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
-        iobuf = kmap_local_page(bvec.bv_page) + bvec.bv_offset;
-#else
-        iobuf = kmap_atomic(bvec.bv_page) + bvec.bv_offset;
-#endif
+    err = vm_insert_page(vmf->vma, vmf->address, page);
+    put_page(page);
+    /* -EBUSY: another thread mapped the page first. */
+    if (err && err != -EBUSY)
+        return err == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
 
-        if (rq_data_dir(rq) == WRITE)
-            memcpy(dev->data + offset, iobuf, len);
-        else
-            memcpy(iobuf, dev->data + offset, len);
+    return VM_FAULT_NOPAGE;
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
-        kunmap_local(iobuf);
+static const struct vm_operations_struct blkram_dax_vm_ops = {
+    .fault = blkram_dax_fault,
+};
+
+static int blkram_dax_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct blkram_dev *dev = file->private_data;
+    unsigned long nr_pages = dev->size >> PAGE_SHIFT;
+
+    if (vma_pages(vma) > nr_pages || vma->vm_pgoff > nr_pages - vma_pages(vma))
+        return -EINVAL;
+    /* A private mapping would copy pages on write, which is not DAX. */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    /* vm_insert_page() from a fault handler needs VM_MIXEDMAP up front.
+     * vm_flags became read-only behind vm_flags_set() in 6.3.
+     */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND);
 #else
-        kunmap_atomic(iobuf);
+    vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND;
 #endif
-        offset += len;
-    }
+    vma->vm_ops = &blkram_dax_vm_ops;
 
-    return BLK_STS_OK;
+    return 0;
 }
 
-static blk_status_t blkram_queue_rq(struct blk_mq_hw_ctx *hctx,
-                                    const struct blk_mq_queue_data *bd)
+/* misc_open() has pointed private_data at our miscdevice. Opening and
+ * misc_deregister() are serialized, so the disk cannot go away in between.
+ */
+static int blkram_dax_open(struct inode *inode, struct file *file)
 {
-    struct request *rq = bd->rq;
-    struct blkram_dev *dev = rq->q->queuedata;
-    blk_status_t status;
+    struct blkram_dev *dev =
+        container_of(file->private_data, struct blkram_dev, dax_misc);
 
-    blk_mq_start_request(rq);
+    kref_get(&dev->ref);
+    file->private_data = dev;
 
-    if (blk_rq_is_passthrough(rq))
-        status = BLK_STS_IOERR;
-    else
-        status = blkram_transfer(dev, rq);
+    return 0;
+}
 
-    blk_mq_end_request(rq, status);
+static int blkram_dax_release(struct inode *inode, struct file *file)
+{
+    struct blkram_dev *dev = file->private_data;
 
-    return BLK_STS_OK;
-}
+    kref_put(&dev->ref, blkram_dev_release);
 
-static const struct blk_mq_ops blkram_mq_ops = {
-    .queue_rq = blkram_queue_rq,
-};
+    return 0;
+}
 
-static const struct block_device_operations blkram_fops = {
+static const struct file_operations blkram_dax_fops = {
     .owner = THIS_MODULE,
+    .open = blkram_dax_open,
+    .release = blkram_dax_release,
+    .mmap = blkram_dax_mmap,
 };
 
-static int __init blkram_init(void)
+/* Settings are checked when a disk is created rather than when they are
+ * written, so they can be changed in any order.
+ */
+static int blkram_config_check(const struct blkram_config *cfg)
+{
+    if (!cfg->mb || !cfg->queue_depth || cfg->queue_depth > BLK_MQ_MAX_DEPTH)
+        return -EINVAL;
+    if (cfg->block_size < SECTOR_SIZE ||
+        cfg->block_size > BLKRAM_MAX_BLOCK_SIZE ||
+        !is_power_of_2(cfg->block_size))
+        return -EINVAL;
+    if (cfg->physical_block_size &&
+        (cfg->physical_block_size < cfg->block_size ||
+         !is_power_of_2(cfg->physical_block_size)))
+        return -EINVAL;
+    /* A request must be able to hold at least a page and a block. */
+    if (cfg->max_hw_sectors_kb &&
+        ((u64)cfg->max_hw_sectors_kb << 10 <
+         max_t(u64, PAGE_SIZE, cfg->block_size)))
+        return -EINVAL;
+    if (cfg->max_segment_size && cfg->max_segment_size < PAGE_SIZE)
+        return -EINVAL;
+    /* Polling and async completion are blk-mq features; the bio path has
+     * no hardware queues and no requests to complete.
+     */
+    if (cfg->bio && (cfg->poll_queues || cfg->async))
+        return -EINVAL;
+    if (cfg->numa_policy > BLKRAM_NUMA_BIND)
+        return -EINVAL;
+    if (cfg->compress && !BLKRAM_HAVE_LZ4)
+        return -EOPNOTSUPP;
+    if (cfg->numa_policy == BLKRAM_NUMA_BIND &&
+        (cfg->numa_node < 0 || cfg->numa_node >= nr_node_ids ||
+         !node_state(cfg->numa_node, N_MEMORY)))
+        return -EINVAL;
+    if (cfg->zone_size_mb) {
+        unsigned long nr = cfg->zone_nr ?: cfg->mb / cfg->zone_size_mb;
+
+        if (!BLKRAM_HAVE_ZONED)
+            return -EOPNOTSUPP;
+        /* Zones are a blk-mq feature here, and the block layer wants
+         * power-of-two zone sizes.
+         */
+        if (cfg->bio || !is_power_of_2(cfg->zone_size_mb))
+            return -EINVAL;
+        if (!nr || nr > UINT_MAX || cfg->zone_nr_conv >= nr)
+            return -EINVAL;
+        /* The image would not carry the zone write pointers. */
+        if (cfg->backing_file)
+            return -EINVAL;
+    }
+    /* Mapped pages are the store itself: there is nothing to decompress
+     * into, no cache in front and no write pointer to follow.
+     */
+    if (cfg->dax && (cfg->compress || cfg->cache_mb || cfg->zone_size_mb))
+        return -EINVAL;
+
+    return 0;
+}
+
+static void blkram_config_init(struct blkram_config *cfg)
 {
-    unsigned long sectors;
+    cfg->mb = blkram_mb;
+    cfg->hw_queues = blkram_hw_queues;
+    cfg->queue_depth = blkram_queue_depth;
+    cfg->block_size = blkram_block_size;
+    cfg->physical_block_size = blkram_physical_block_size;
+    cfg->max_hw_sectors_kb = blkram_max_hw_sectors_kb;
+    cfg->max_segments = blkram_max_segments;
+    cfg->max_segment_size = blkram_max_segment_size;
+    cfg->bio = blkram_bio;
+    cfg->poll_queues = blkram_poll_queues;
+    cfg->async = blkram_async;
+    cfg->numa_policy = blkram_numa_policy;
+    cfg->numa_node = blkram_numa_node;
+    cfg->compress = blkram_compress;
+    cfg->cache_mb = blkram_cache_mb;
+    cfg->zone_size_mb = blkram_zone_size_mb;
+    cfg->zone_nr = blkram_zone_nr;
+    cfg->zone_nr_conv = blkram_zone_nr_conv;
+    /* Disks must not share an image, so only the load-time disks get one
+     * from the module parameters.
+     */
+    cfg->backing_file = NULL;
+    cfg->dax = blkram_dax;
+}
+
+/* Create and register one disk. Called with blkram_lock held. */
+static struct blkram_dev *blkram_dev_create(const struct blkram_config *cfg)
+{
+    unsigned int max_hw_sectors = cfg->max_hw_sectors_kb << 1;
+    unsigned int discard_granularity;
+    struct blkram_dev *dev;
+    sector_t sectors;
     int ret;
 
-    blkram_major = register_blkdev(0, "blkram");
-    if (blkram_major < 0)
-        return blkram_major;
+    ret = blkram_config_check(cfg);
+    if (ret)
+        return ERR_PTR(ret);
+
+    /* Discard frees whole backing pages, so smaller units are pointless. */
+    discard_granularity = max3((unsigned int)PAGE_SIZE, cfg->block_size,
+                               cfg->physical_block_size);
 
-    blkram = kzalloc(sizeof(*blkram), GFP_KERNEL);
-    if (!blkram) {
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+    kref_init(&dev->ref);
+
+    /* Every disk has one minor of the shared major, numbered like its name.
+     */
+    dev->id = ida_alloc_max(&blkram_ida, MINORMASK, GFP_KERNEL);
+    if (dev->id < 0) {
+        ret = dev->id;
+        goto err_free_dev;
+    }
+
+    /* Nothing is allocated up front: pages appear as sectors are written, so
+     * a multi-GiB disk costs only what is actually touched.
+     */
+    dev->size = (u64)cfg->mb << 20;
+    xa_init(&dev->maps[0]);
+    xa_init(&dev->maps[1]);
+    dev->pages = &dev->maps[0];
+    mutex_init(&dev->snap_lock);
+    INIT_WORK(&dev->load_work, blkram_load_work);
+    INIT_WORK(&dev->save_work, blkram_save_work);
+    init_waitqueue_head(&dev->load_wq);
+    init_waitqueue_head(&dev->shrink_wq);
+    dev->load_next = dev->size >> PAGE_SHIFT;
+    dev->bio = cfg->bio;
+    dev->block_size = cfg->block_size;
+    dev->poll_queues = cfg->poll_queues;
+    dev->async = cfg->async;
+    dev->dax = cfg->dax;
+
+    dev->numa_policy = cfg->numa_policy;
+    dev->numa_node =
+        cfg->numa_policy == BLKRAM_NUMA_BIND ? cfg->numa_node : NUMA_NO_NODE;
+
+    ret = blkram_init_numa(dev);
+    if (ret)
+        goto err_free_id;
+
+    dev->async_inflight = alloc_percpu(long);
+    if (!dev->async_inflight) {
         ret = -ENOMEM;
-        goto err_unreg;
+        goto err_free_numa;
     }
 
-    blkram->size = blkram_mb * 1024 * 1024;
-    sectors = blkram->size / BLKRAM_SECTOR_SIZE;
+    dev->lat = alloc_percpu(struct blkram_lat);
+    if (!dev->lat) {
+        ret = -ENOMEM;
+        goto err_free_percpu;
+    }
 
-    blkram->data = vzalloc(blkram->size);
-    if (!blkram->data) {
+    dev->stat = alloc_percpu(struct blkram_stat);
+    if (!dev->stat) {
         ret = -ENOMEM;
-        goto err_free_dev;
+        goto err_free_lat;
     }
 
-    blkram->tag_set.ops = &blkram_mq_ops;
-    blkram->tag_set.nr_hw_queues = 1;
-    blkram->tag_set.queue_depth = 64;
-    blkram->tag_set.numa_node = NUMA_NO_NODE;
-    blkram->tag_set.cmd_size = 0;
-    /* BLK_MQ_F_SHOULD_MERGE was removed in 6.6+; merging is always on. */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
-    blkram->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
-#else
-    blkram->tag_set.flags = 0;
-#endif
-    blkram->tag_set.driver_data = blkram;
+    dev->compress = cfg->compress;
+    if (dev->compress) {
+        ret = blkram_init_compress(dev);
+        if (ret)
+            goto err_free_stat;
+    }
 
-    ret = blk_mq_alloc_tag_set(&blkram->tag_set);
-    if (ret)
-        goto err_free_data;
+    if (cfg->cache_mb) {
+        ret = blkram_init_cache(dev, cfg->cache_mb);
+        if (ret)
+            goto err_free_compress;
+    }
+
+    /* Mapped DAX pages must stay where they are. */
+    dev->shrink = !dev->compress && !dev->dax;
+    if (dev->shrink) {
+        ret = blkram_init_shrinker(dev);
+        if (ret)
+            goto err_free_cache;
+    }
+
+    /* A zoned disk's size is a whole number of zones. */
+    if (cfg->zone_size_mb) {
+        ret = blkram_init_zones(dev, cfg);
+        if (ret)
+            goto err_free_shrinker;
+    }
+    sectors = dev->size >> SECTOR_SHIFT;
+
+    /* Loading runs in the background, so it can start before the disk is
+     * even allocated; I/O that gets ahead of it waits.
+     */
+    if (cfg->backing_file) {
+        dev->backing_file = kstrdup(cfg->backing_file, GFP_KERNEL);
+        if (!dev->backing_file) {
+            ret = -ENOMEM;
+            goto err_free_zones;
+        }
+        ret = blkram_start_load(dev);
+        if (ret)
+            goto err_free_zones;
+    }
+
+    if (!dev->bio) {
+        ret = blkram_init_tag_set(dev, cfg);
+        if (ret)
+            goto err_stop_load;
+    }
 
 /* Three eras of block-device creation:
  *   6.9+      blk_mq_alloc_disk(set, lim, queuedata)  -- 3-arg form.
  *   5.15-6.8  blk_mq_alloc_disk(set, queuedata)       -- 2-arg form.
  *   5.10-5.14 alloc_disk() + blk_mq_init_queue()      -- separate objects.
+ * Bio-based disks follow the same eras with blk_alloc_disk() and
+ * blk_alloc_queue().
  */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
     {
         struct queue_limits lim = {
-            .logical_block_size = BLKRAM_SECTOR_SIZE,
+            .logical_block_size = dev->block_size,
+            .physical_block_size = cfg->physical_block_size,
+            .max_hw_sectors = max_hw_sectors,
+            .max_segments = cfg->max_segments,
+            .max_segment_size = cfg->max_segment_size,
+            .max_hw_discard_sectors = BLKRAM_MAX_DISCARD_SECTORS,
+            .max_write_zeroes_sectors = BLKRAM_MAX_DISCARD_SECTORS,
+            .discard_granularity = discard_granularity,
         };
-        blkram->disk = blk_mq_alloc_disk(&blkram->tag_set, &lim, blkram);
+/* Cache and FUA support became queue_limits features in 6.11. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+        if (dev->cache_limit)
+            lim.features |= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA;
+#endif
+#if BLKRAM_HAVE_ZONED
+        /* Zone resets free the pages instead of discard. The zone append
+         * limit was renamed to a hardware limit in 6.13.
+         */
+        if (dev->zones) {
+            lim.features |= BLK_FEAT_ZONED;
+            lim.chunk_sectors = dev->zone_sectors;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+            lim.max_hw_zone_append_sectors = dev->zone_sectors;
+#else
+            lim.max_zone_append_sectors = dev->zone_sectors;
+#endif
+            lim.max_hw_discard_sectors = 0;
+            lim.max_write_zeroes_sectors = 0;
+        }
+#endif
+        if (dev->bio)
+            dev->disk = blk_alloc_disk(&lim, dev->numa_node);
+        else
+            dev->disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
     }
-    if (IS_ERR(blkram->disk)) {
-        ret = PTR_ERR(blkram->disk);
+    if (IS_ERR(dev->disk)) {
+        ret = PTR_ERR(dev->disk);
         goto err_tag_set;
     }
-    blkram->queue = blkram->disk->queue;
+    dev->queue = dev->disk->queue;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
-    blkram->disk = blk_mq_alloc_disk(&blkram->tag_set, blkram);
-    if (IS_ERR(blkram->disk)) {
-        ret = PTR_ERR(blkram->disk);
+    /* blk_alloc_disk() reports failure with NULL before 6.9. */
+    if (dev->bio)
+        dev->disk = blk_alloc_disk(dev->numa_node) ?: ERR_PTR(-ENOMEM);
+    else
+        dev->disk = blk_mq_alloc_disk(&dev->tag_set, dev);
+    if (IS_ERR(dev->disk)) {
+        ret = PTR_ERR(dev->disk);
         goto err_tag_set;
     }
-    blkram->queue = blkram->disk->queue;
+    dev->queue = dev->disk->queue;
 #else
-    blkram->queue = blk_mq_init_queue(&blkram->tag_set);
-    if (IS_ERR(blkram->queue)) {
-        ret = PTR_ERR(blkram->queue);
+    if (dev->bio)
+        dev->queue = blk_alloc_queue(dev->numa_node) ?: ERR_PTR(-ENOMEM);
+    else
+        dev->queue = blk_mq_init_queue(&dev->tag_set);
+    if (IS_ERR(dev->queue)) {
+        ret = PTR_ERR(dev->queue);
         goto err_tag_set;
     }
 
-    blkram->disk = alloc_disk(1);
-    if (!blkram->disk) {
+    dev->disk = alloc_disk(1);
+    if (!dev->disk) {
         ret = -ENOMEM;
         goto err_cleanup_queue;
     }
 
-    blkram->disk->queue = blkram->queue;
+    dev->disk->queue = dev->queue;
 #endif
 
-    blkram->queue->queuedata = blkram;
-    blkram->disk->major = blkram_major;
-    blkram->disk->first_minor = 0;
-    blkram->disk->minors = 1;
-    blkram->disk->fops = &blkram_fops;
-    blkram->disk->private_data = blkram;
+    dev->queue->queuedata = dev;
+    dev->disk->major = blkram_major;
+    dev->disk->first_minor = dev->id;
+    dev->disk->minors = 1;
+    dev->disk->fops = dev->bio ? &blkram_bio_fops : &blkram_fops;
+    dev->disk->private_data = dev;
 
-    snprintf(blkram->disk->disk_name, DISK_NAME_LEN, "blkram0");
+    snprintf(dev->disk->disk_name, DISK_NAME_LEN, "blkram%d", dev->id);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
-    blk_queue_logical_block_size(blkram->queue, BLKRAM_SECTOR_SIZE);
+    blk_queue_logical_block_size(dev->queue, dev->block_size);
+    if (cfg->physical_block_size)
+        blk_queue_physical_block_size(dev->queue, cfg->physical_block_size);
+    if (max_hw_sectors)
+        blk_queue_max_hw_sectors(dev->queue, max_hw_sectors);
+    if (cfg->max_segments)
+        blk_queue_max_segments(dev->queue, cfg->max_segments);
+    if (cfg->max_segment_size)
+        blk_queue_max_segment_size(dev->queue, cfg->max_segment_size);
+    blk_queue_max_discard_sectors(dev->queue, BLKRAM_MAX_DISCARD_SECTORS);
+    blk_queue_max_write_zeroes_sectors(dev->queue,
+                                       BLKRAM_MAX_DISCARD_SECTORS);
+    dev->queue->limits.discard_granularity = discard_granularity;
+#endif
+    /* QUEUE_FLAG_DISCARD was dropped in 5.19; a non-zero limit is enough. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+    if (dev->cache_limit)
+        blk_queue_write_cache(dev->queue, true, true);
+#endif
+    set_capacity(dev->disk, sectors);
+
+#if BLKRAM_HAVE_ZONED
+    /* Let the block layer read the zone layout through ->report_zones(). */
+    if (dev->zones) {
+        ret = blk_revalidate_disk_zones(dev->disk);
+        if (ret)
+            goto err_put_disk;
+    }
 #endif
-    set_capacity(blkram->disk, sectors);
 
-    /* add_disk() returns int since 5.16; earlier kernels return void. */
+    /* device_add_disk() returns int since 5.16; earlier kernels return
+     * void. It is add_disk() plus sysfs attribute groups for the disk.
+     */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
-    ret = add_disk(blkram->disk);
+    ret = device_add_disk(NULL, dev->disk, blkram_attr_groups);
     if (ret)
         goto err_put_disk;
 #else
-    add_disk(blkram->disk);
+    device_add_disk(NULL, dev->disk, blkram_attr_groups);
 #endif
 
-    pr_info("blkram: registered /dev/%s (%lu MiB)\n", blkram->disk->disk_name,
-            blkram_mb);
+    if (dev->dax) {
+        snprintf(dev->dax_name, sizeof(dev->dax_name), "%s_dax",
+                 dev->disk->disk_name);
+        dev->dax_misc.minor = MISC_DYNAMIC_MINOR;
+        dev->dax_misc.name = dev->dax_name;
+        dev->dax_misc.fops = &blkram_dax_fops;
+        ret = misc_register(&dev->dax_misc);
+        if (ret) {
+            del_gendisk(dev->disk);
+            goto err_put_disk;
+        }
+    }
 
-    return 0;
+    blkram_debugfs_init(dev);
+    list_add_tail(&dev->list, &blkram_devs);
+
+    if (dev->bio)
+        pr_info("blkram: registered /dev/%s (%lu MiB, bio-based)\n",
+                dev->disk->disk_name, cfg->mb);
+    else
+        pr_info("blkram: registered /dev/%s (%lu MiB, %u queues x %u tags, "
+                "%u for polling%s)\n",
+                dev->disk->disk_name, cfg->mb, dev->tag_set.nr_hw_queues,
+                dev->tag_set.queue_depth, dev->poll_queues,
+                dev->async ? ", async" : "");
+
+    return dev;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
 err_put_disk:
-    put_disk(blkram->disk);
-#endif
+    put_disk(dev->disk);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
 err_cleanup_queue:
-    blk_cleanup_queue(blkram->queue);
+    blk_cleanup_queue(dev->queue);
 #endif
 err_tag_set:
-    blk_mq_free_tag_set(&blkram->tag_set);
-err_free_data:
-    vfree(blkram->data);
+    if (!dev->bio)
+        blk_mq_free_tag_set(&dev->tag_set);
+err_stop_load:
+    blkram_stop_load(dev);
+err_free_zones:
+    kvfree(dev->zones);
+err_free_shrinker:
+    if (dev->shrink)
+        blkram_free_shrinker(dev);
+    /* Whatever the loader stored, once no scan can be looking at it. */
+    blkram_free_pages(dev);
+err_free_cache:
+    if (dev->cache_limit)
+        blkram_free_cache(dev);
+err_free_compress:
+    if (dev->compress)
+        blkram_free_compress(dev);
+err_free_stat:
+    free_percpu(dev->stat);
+err_free_lat:
+    free_percpu(dev->lat);
+err_free_percpu:
+    free_percpu(dev->async_inflight);
+err_free_numa:
+    blkram_free_numa(dev);
+err_free_id:
+    ida_free(&blkram_ida, dev->id);
 err_free_dev:
-    kfree(blkram);
+    kfree(dev->backing_file);
+    kfree(dev);
+    return ERR_PTR(ret);
+}
+
+/* Called with blkram_lock held. The store goes with the last reference. */
+static void blkram_dev_destroy(struct blkram_dev *dev)
+{
+    list_del(&dev->list);
+    debugfs_remove_recursive(dev->debugfs);
+    if (dev->dax)
+        misc_deregister(&dev->dax_misc);
+    /* Stopping the loader early also releases any I/O waiting for it. */
+    blkram_stop_load(dev);
+    blkram_stop_save(dev);
+    del_gendisk(dev->disk);
+    put_disk(dev->disk);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+    blk_cleanup_queue(dev->queue);
+#endif
+    if (!dev->bio)
+        blk_mq_free_tag_set(&dev->tag_set);
+    kref_put(&dev->ref, blkram_dev_release);
+}
+
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+/* Runtime disks, in the style of null_blk:
+ *
+ *   mkdir /sys/kernel/config/blkram/foo
+ *   echo 64 > /sys/kernel/config/blkram/foo/mb
+ *   echo 1 > /sys/kernel/config/blkram/foo/power
+ *   cat /sys/kernel/config/blkram/foo/disk        # blkram1
+ *   echo 0 > /sys/kernel/config/blkram/foo/power  # or rmdir
+ *
+ * A new directory starts out with the module parameters as its settings,
+ * which can only be changed while the disk is powered off.
+ */
+static struct blkram_config *to_blkram_config(struct config_item *item)
+{
+    return container_of(to_config_group(item), struct blkram_config, group);
+}
+
+static int blkram_kstrtoul(const char *s, unsigned long *res)
+{
+    return kstrtoul(s, 0, res);
+}
+
+static int blkram_kstrtouint(const char *s, unsigned int *res)
+{
+    return kstrtouint(s, 0, res);
+}
+
+static int blkram_kstrtoint(const char *s, int *res)
+{
+    return kstrtoint(s, 0, res);
+}
+
+#define BLKRAM_CONFIG_ATTR(_name, _type, _parse, _fmt)                       \
+    static ssize_t blkram_config_##_name##_show(struct config_item *item,    \
+                                                char *page)                  \
+    {                                                                        \
+        return snprintf(page, PAGE_SIZE, _fmt "\n",                          \
+                        to_blkram_config(item)->_name);                      \
+    }                                                                        \
+    static ssize_t blkram_config_##_name##_store(                            \
+        struct config_item *item, const char *page, size_t count)            \
+    {                                                                        \
+        struct blkram_config *cfg = to_blkram_config(item);                  \
+        _type val;                                                           \
+        int ret;                                                             \
+                                                                             \
+        ret = _parse(page, &val);                                            \
+        if (ret)                                                             \
+            return ret;                                                      \
+        mutex_lock(&blkram_lock);                                            \
+        if (cfg->dev)                                                        \
+            ret = -EBUSY;                                                    \
+        else                                                                 \
+            cfg->_name = val;                                                \
+        mutex_unlock(&blkram_lock);                                          \
+        return ret ? ret : count;                                            \
+    }                                                                        \
+    CONFIGFS_ATTR(blkram_config_, _name)
+
+BLKRAM_CONFIG_ATTR(mb, unsigned long, blkram_kstrtoul, "%lu");
+BLKRAM_CONFIG_ATTR(hw_queues, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(queue_depth, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(block_size, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(physical_block_size, unsigned int, blkram_kstrtouint,
+                   "%u");
+BLKRAM_CONFIG_ATTR(max_hw_sectors_kb, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(max_segments, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(max_segment_size, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(bio, bool, kstrtobool, "%d");
+BLKRAM_CONFIG_ATTR(poll_queues, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(async, bool, kstrtobool, "%d");
+BLKRAM_CONFIG_ATTR(numa_policy, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(numa_node, int, blkram_kstrtoint, "%d");
+BLKRAM_CONFIG_ATTR(compress, bool, kstrtobool, "%d");
+BLKRAM_CONFIG_ATTR(cache_mb, unsigned long, blkram_kstrtoul, "%lu");
+BLKRAM_CONFIG_ATTR(zone_size_mb, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(zone_nr, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(zone_nr_conv, unsigned int, blkram_kstrtouint, "%u");
+BLKRAM_CONFIG_ATTR(dax, bool, kstrtobool, "%d");
+
+static ssize_t blkram_config_power_show(struct config_item *item, char *page)
+{
+    return snprintf(page, PAGE_SIZE, "%d\n", !!to_blkram_config(item)->dev);
+}
+
+static ssize_t blkram_config_power_store(struct config_item *item,
+                                         const char *page, size_t count)
+{
+    struct blkram_config *cfg = to_blkram_config(item);
+    struct blkram_dev *dev;
+    bool power;
+    int ret;
+
+    ret = kstrtobool(page, &power);
+    if (ret)
+        return ret;
+
+    mutex_lock(&blkram_lock);
+    if (power && !cfg->dev) {
+        dev = blkram_dev_create(cfg);
+        if (IS_ERR(dev))
+            ret = PTR_ERR(dev);
+        else
+            cfg->dev = dev;
+    } else if (!power && cfg->dev) {
+        blkram_dev_destroy(cfg->dev);
+        cfg->dev = NULL;
+    }
+    mutex_unlock(&blkram_lock);
+
+    return ret ? ret : count;
+}
+CONFIGFS_ATTR(blkram_config_, power);
+
+static ssize_t blkram_config_disk_show(struct config_item *item, char *page)
+{
+    struct blkram_config *cfg = to_blkram_config(item);
+    ssize_t ret;
+
+    mutex_lock(&blkram_lock);
+    ret = snprintf(page, PAGE_SIZE, "%s\n",
+                   cfg->dev ? cfg->dev->disk->disk_name : "");
+    mutex_unlock(&blkram_lock);
+
+    return ret;
+}
+CONFIGFS_ATTR_RO(blkram_config_, disk);
+
+static ssize_t blkram_config_backing_file_show(struct config_item *item,
+                                               char *page)
+{
+    struct blkram_config *cfg = to_blkram_config(item);
+    ssize_t ret;
+
+    mutex_lock(&blkram_lock);
+    ret = snprintf(page, PAGE_SIZE, "%s\n", cfg->backing_file ?: "");
+    mutex_unlock(&blkram_lock);
+
+    return ret;
+}
+
+/* An empty string removes the backing file. */
+static ssize_t blkram_config_backing_file_store(struct config_item *item,
+                                                const char *page, size_t count)
+{
+    struct blkram_config *cfg = to_blkram_config(item);
+    char *path;
+    int ret = 0;
+
+    path = kmemdup_nul(page, count, GFP_KERNEL);
+    if (!path)
+        return -ENOMEM;
+    path[strcspn(path, "\n")] = '\0';
+    if (!*path) {
+        kfree(path);
+        path = NULL;
+    }
+
+    mutex_lock(&blkram_lock);
+    if (cfg->dev)
+        ret = -EBUSY;
+    else
+        swap(cfg->backing_file, path);
+    mutex_unlock(&blkram_lock);
+    kfree(path);
+
+    return ret ? ret : count;
+}
+CONFIGFS_ATTR(blkram_config_, backing_file);
+
+static struct configfs_attribute *blkram_config_attrs[] = {
+    &blkram_config_attr_mb,
+    &blkram_config_attr_hw_queues,
+    &blkram_config_attr_queue_depth,
+    &blkram_config_attr_block_size,
+    &blkram_config_attr_physical_block_size,
+    &blkram_config_attr_max_hw_sectors_kb,
+    &blkram_config_attr_max_segments,
+    &blkram_config_attr_max_segment_size,
+    &blkram_config_attr_bio,
+    &blkram_config_attr_poll_queues,
+    &blkram_config_attr_async,
+    &blkram_config_attr_numa_policy,
+    &blkram_config_attr_numa_node,
+    &blkram_config_attr_compress,
+    &blkram_config_attr_cache_mb,
+    &blkram_config_attr_zone_size_mb,
+    &blkram_config_attr_zone_nr,
+    &blkram_config_attr_zone_nr_conv,
+    &blkram_config_attr_backing_file,
+    &blkram_config_attr_dax,
+    &blkram_config_attr_power,
+    &blkram_config_attr_disk,
+    NULL,
+};
+
+static void blkram_config_release(struct config_item *item)
+{
+    struct blkram_config *cfg = to_blkram_config(item);
+
+    kfree(cfg->backing_file);
+    kfree(cfg);
+}
+
+static struct configfs_item_operations blkram_config_item_ops = {
+    .release = blkram_config_release,
+};
+
+static const struct config_item_type blkram_config_type = {
+    .ct_item_ops = &blkram_config_item_ops,
+    .ct_attrs = blkram_config_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct config_group *blkram_group_make_group(struct config_group *group,
+                                                    const char *name)
+{
+    struct blkram_config *cfg;
+
+    cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+        return ERR_PTR(-ENOMEM);
+
+    blkram_config_init(cfg);
+    config_group_init_type_name(&cfg->group, name, &blkram_config_type);
+
+    return &cfg->group;
+}
+
+/* rmdir powers the disk off first. */
+static void blkram_group_drop_item(struct config_group *group,
+                                   struct config_item *item)
+{
+    struct blkram_config *cfg = to_blkram_config(item);
+
+    mutex_lock(&blkram_lock);
+    if (cfg->dev) {
+        blkram_dev_destroy(cfg->dev);
+        cfg->dev = NULL;
+    }
+    mutex_unlock(&blkram_lock);
+
+    config_item_put(item);
+}
+
+static struct configfs_group_operations blkram_group_ops = {
+    .make_group = blkram_group_make_group,
+    .drop_item = blkram_group_drop_item,
+};
+
+static const struct config_item_type blkram_group_type = {
+    .ct_group_ops = &blkram_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem blkram_subsys = {
+    .su_group = {
+        .cg_item = {
+            .ci_namebuf = "blkram",
+            .ci_type = &blkram_group_type,
+        },
+    },
+};
+
+static int blkram_configfs_init(void)
+{
+    config_group_init(&blkram_subsys.su_group);
+    mutex_init(&blkram_subsys.su_mutex);
+
+    return configfs_register_subsystem(&blkram_subsys);
+}
+
+static void blkram_configfs_exit(void)
+{
+    configfs_unregister_subsystem(&blkram_subsys);
+}
+#else
+static int blkram_configfs_init(void)
+{
+    return 0;
+}
+
+static void blkram_configfs_exit(void)
+{
+}
+#endif
+
+static void blkram_destroy_all(void)
+{
+    struct blkram_dev *dev, *next;
+
+    mutex_lock(&blkram_lock);
+    list_for_each_entry_safe(dev, next, &blkram_devs, list)
+    {
+        blkram_dev_destroy(dev);
+    }
+    mutex_unlock(&blkram_lock);
+}
+
+static int __init blkram_init(void)
+{
+    struct blkram_config cfg;
+    unsigned int i;
+    int ret;
+
+    blkram_major = register_blkdev(0, "blkram");
+    if (blkram_major < 0)
+        return blkram_major;
+
+    /* A bound (per-CPU) workqueue runs each work item on the CPU that
+     * queued it. WQ_MEM_RECLAIM because writeback may depend on it. It is
+     * shared by every disk in async mode.
+     */
+    blkram_wq = alloc_workqueue("blkram", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+    if (!blkram_wq) {
+        ret = -ENOMEM;
+        goto err_unreg;
+    }
+
+    blkram_debugfs = debugfs_create_dir("blkram", NULL);
+    debugfs_create_file("latency_enable", 0600, blkram_debugfs, NULL,
+                        &blkram_lat_enable_fops);
+
+    /* The module parameters describe the disks created at load time. */
+    blkram_config_init(&cfg);
+    mutex_lock(&blkram_lock);
+    for (i = 0; i < blkram_nr_devices; i++) {
+        struct blkram_dev *dev;
+
+        if (blkram_backing_file && blkram_nr_devices > 1)
+            cfg.backing_file =
+                kasprintf(GFP_KERNEL, "%s.%u", blkram_backing_file, i);
+        else
+            cfg.backing_file = kstrdup(blkram_backing_file, GFP_KERNEL);
+        if (blkram_backing_file && !cfg.backing_file)
+            dev = ERR_PTR(-ENOMEM);
+        else
+            dev = blkram_dev_create(&cfg);
+        kfree(cfg.backing_file);
+
+        if (IS_ERR(dev)) {
+            ret = PTR_ERR(dev);
+            mutex_unlock(&blkram_lock);
+            goto err_destroy;
+        }
+    }
+    mutex_unlock(&blkram_lock);
+
+    ret = blkram_configfs_init();
+    if (ret)
+        goto err_destroy;
+
+    return 0;
+
+err_destroy:
+    blkram_destroy_all();
+    debugfs_remove_recursive(blkram_debugfs);
+    destroy_workqueue(blkram_wq);
 err_unreg:
     unregister_blkdev(blkram_major, "blkram");
     return ret;
@@ -241,15 +4058,16 @@ err_unreg:
 
 static void __exit blkram_exit(void)
 {
-    del_gendisk(blkram->disk);
-    put_disk(blkram->disk);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
-    blk_cleanup_queue(blkram->queue);
-#endif
-    blk_mq_free_tag_set(&blkram->tag_set);
-    vfree(blkram->data);
-    kfree(blkram);
+    /* configfs holds a module reference for every directory, so only the
+     * load-time disks can be left by now.
+     */
+    blkram_configfs_exit();
+    blkram_destroy_all();
+    debugfs_remove_recursive(blkram_debugfs);
+    destroy_workqueue(blkram_wq);
     unregister_blkdev(blkram_major, "blkram");
+    /* Wait for pages freed by discard before the callback code goes away. */
+    rcu_barrier();
 }
 
 module_init(blkram_init);
@@ -0,0 +1,615 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * blkram_bench.c - In-kernel I/O generator for measuring a block driver
+ * without system call, VFS or user-space overhead.
+ *
+ * One kthread per CPU keeps a fixed number of bios in flight against a
+ * block device, and completions are timed into a per-CPU latency histogram
+ * that the results are computed from:
+ *
+ *   insmod blkram_bench.ko bench_dev=/dev/blkram0 bs=4096 depth=32
+ *   echo 1 > /sys/kernel/debug/blkram_bench/run   # returns when done
+ *   cat /sys/kernel/debug/blkram_bench/results
+ *
+ * The parameters can be changed between runs through
+ * /sys/module/blkram_bench/parameters/. Loading the module starts nothing.
+ */
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+
+static char *bench_dev = "/dev/blkram0";
+module_param(bench_dev, charp, 0644);
+MODULE_PARM_DESC(bench_dev, "Block device to run against");
+
+static unsigned int bs = 4096;
+module_param(bs, uint, 0644);
+MODULE_PARM_DESC(bs, "I/O size in bytes, up to 1 MiB");
+
+static unsigned int depth = 32;
+module_param(depth, uint, 0644);
+MODULE_PARM_DESC(depth, "I/Os in flight per thread");
+
+static unsigned int read_pct = 100;
+module_param(read_pct, uint, 0644);
+MODULE_PARM_DESC(read_pct, "Percentage of reads; the rest are writes");
+
+static bool rand_offsets = true;
+module_param_named(random, rand_offsets, bool, 0644);
+MODULE_PARM_DESC(random, "Random offsets rather than sequential");
+
+static unsigned int runtime_ms = 5000;
+module_param(runtime_ms, uint, 0644);
+MODULE_PARM_DESC(runtime_ms, "Length of a run in milliseconds");
+
+static unsigned int threads;
+module_param(threads, uint, 0644);
+MODULE_PARM_DESC(threads, "Number of threads (0 = one per online CPU)");
+
+/* Latency buckets: exact below 16 ns, then 16 per power of two, so a
+ * reported percentile is at most 1/16 below the real value.
+ */
+#define BENCH_SUB_BITS 4
+#define BENCH_SUB (1U << BENCH_SUB_BITS)
+#define BENCH_BUCKETS ((64 - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS)
+
+struct bench_stat {
+    u64 ios[2]; /* indexed by op_is_write() */
+    u64 bytes[2];
+    u64 errors;
+    u64 hist[BENCH_BUCKETS];
+};
+
+struct bench_thread;
+
+/* One I/O slot: a buffer and, while it is in flight, a bio. */
+struct bench_slot {
+    struct list_head list; /* on the thread's free list */
+    struct bench_thread *thread;
+    struct page *page;
+    u64 start_ns;
+};
+
+struct bench_thread {
+    struct task_struct *task;
+    spinlock_t lock; /* protects free and inflight */
+    struct list_head free;
+    unsigned int inflight;
+    wait_queue_head_t wq;
+    sector_t next; /* next sector of a sequential run */
+    sector_t first, end; /* this thread's share of the disk */
+    struct bench_slot *slots;
+};
+
+/* What a finished run left for the results file. */
+struct bench_result {
+    bool valid;
+    char dev[64];
+    unsigned int threads, depth, bs, read_pct;
+    bool random;
+    u64 elapsed_ns;
+    u64 ios[2];
+    u64 bytes[2];
+    u64 errors;
+    u64 pct_ns[5];
+    u64 max_ns;
+};
+
+/* In units of 1/100000. */
+static const unsigned int bench_pcts[5] = { 50000, 90000, 99000, 99900,
+                                            99990 };
+static const char *const bench_pct_names[5] = { "p50", "p90", "p99", "p99.9",
+                                                "p99.99" };
+
+static DEFINE_MUTEX(bench_lock); /* one run at a time; guards bench_result */
+static struct bench_result bench_result;
+static struct dentry *bench_debugfs;
+
+/* The state of the run in progress. */
+static struct block_device *bench_bdev;
+static struct bench_stat __percpu *bench_stat;
+static unsigned int bench_bs, bench_depth, bench_read_pct;
+static bool bench_random;
+static sector_t bench_blocks; /* the disk size in units of bench_bs */
+
+static unsigned int bench_bucket(u64 ns)
+{
+    unsigned int msb;
+
+    if (ns < BENCH_SUB)
+        return ns;
+    msb = fls64(ns) - 1;
+    return ((msb - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+           ((ns >> (msb - BENCH_SUB_BITS)) & (BENCH_SUB - 1));
+}
+
+/* The smallest latency that lands in bucket @b. */
+static u64 bench_bucket_ns(unsigned int b)
+{
+    if (b < BENCH_SUB)
+        return b;
+    return (u64)(BENCH_SUB | (b & (BENCH_SUB - 1)))
+           << ((b >> BENCH_SUB_BITS) - 1);
+}
+
+/* Completions may run in interrupt context on any CPU, so they count into
+ * that CPU's statistics with this_cpu ops and only take the lock of the
+ * thread the slot belongs to.
+ */
+static void bench_end_io(struct bio *bio)
+{
+    struct bench_slot *slot = bio->bi_private;
+    struct bench_thread *t = slot->thread;
+    u64 ns = ktime_get_ns() - slot->start_ns;
+    int write = op_is_write(bio_op(bio));
+    unsigned long flags;
+
+    if (bio->bi_status)
+        this_cpu_inc(bench_stat->errors);
+    this_cpu_inc(bench_stat->ios[write]);
+    this_cpu_add(bench_stat->bytes[write], bench_bs);
+    this_cpu_inc(bench_stat->hist[bench_bucket(ns)]);
+    bio_put(bio);
+
+    /* The thread exits once it has seen inflight drop to zero under the
+     * lock, so nothing here may touch @t after the unlock.
+     */
+    spin_lock_irqsave(&t->lock, flags);
+    list_add(&slot->list, &t->free);
+    t->inflight--;
+    wake_up(&t->wq);
+    spin_unlock_irqrestore(&t->lock, flags);
+}
+
+static sector_t bench_next_sector(struct bench_thread *t)
+{
+    sector_t block;
+
+    if (bench_random) {
+        block = mul_u64_u32_shr(bench_blocks, get_random_u32(), 32);
+    } else {
+        block = t->next++;
+        if (t->next >= t->end)
+            t->next = t->first;
+    }
+
+    return block * (bench_bs >> SECTOR_SHIFT);
+}
+
+static void bench_submit(struct bench_thread *t, struct bench_slot *slot)
+{
+    bool write = get_random_u32() % 100 >= bench_read_pct;
+    unsigned int opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+    struct bio *bio;
+
+/* bio_alloc() takes the device and operation since 5.18. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    bio = bio_alloc(bench_bdev, 1, opf, GFP_NOIO);
+#else
+    bio = bio_alloc(GFP_NOIO, 1);
+    bio_set_dev(bio, bench_bdev);
+    bio->bi_opf = opf;
+#endif
+    bio->bi_iter.bi_sector = bench_next_sector(t);
+    bio_add_page(bio, slot->page, bench_bs, 0);
+    bio->bi_private = slot;
+    bio->bi_end_io = bench_end_io;
+
+    slot->start_ns = ktime_get_ns();
+    submit_bio(bio);
+}
+
+/* Keep bench_depth I/Os in flight until told to stop, then wait for them. */
+static int bench_thread_fn(void *data)
+{
+    struct bench_thread *t = data;
+    struct bench_slot *slot;
+
+    spin_lock_irq(&t->lock);
+    for (;;) {
+        wait_event_lock_irq(t->wq,
+                            !list_empty(&t->free) || kthread_should_stop(),
+                            t->lock);
+        if (kthread_should_stop())
+            break;
+
+        slot = list_first_entry(&t->free, struct bench_slot, list);
+        list_del(&slot->list);
+        t->inflight++;
+        spin_unlock_irq(&t->lock);
+
+        bench_submit(t, slot);
+        /* A RAM disk may complete every bio inside submit_bio(). */
+        cond_resched();
+        spin_lock_irq(&t->lock);
+    }
+    wait_event_lock_irq(t->wq, !t->inflight, t->lock);
+    spin_unlock_irq(&t->lock);
+
+    return 0;
+}
+
+static void bench_free_thread(struct bench_thread *t)
+{
+    unsigned int i;
+
+    if (!t)
+        return;
+    for (i = 0; t->slots && i < bench_depth; i++) {
+        if (t->slots[i].page)
+            __free_pages(t->slots[i].page, get_order(bench_bs));
+    }
+    kfree(t->slots);
+    kfree(t);
+}
+
+static struct bench_thread *bench_alloc_thread(unsigned int cpu,
+                                               unsigned int nr,
+                                               unsigned int idx)
+{
+    int node = cpu_to_node(cpu);
+    struct bench_thread *t;
+    unsigned int i;
+
+    t = kzalloc_node(sizeof(*t), GFP_KERNEL, node);
+    if (!t)
+        return NULL;
+
+    spin_lock_init(&t->lock);
+    INIT_LIST_HEAD(&t->free);
+    init_waitqueue_head(&t->wq);
+    /* Sequential runs give each thread a slice of the disk to stream. */
+    t->first = div_u64(bench_blocks * idx, nr);
+    t->end = div_u64(bench_blocks * (idx + 1), nr);
+    if (t->end == t->first)
+        t->end = t->first + 1;
+    t->next = t->first;
+
+    t->slots = kcalloc_node(bench_depth, sizeof(*t->slots), GFP_KERNEL, node);
+    if (!t->slots)
+        goto err;
+
+    for (i = 0; i < bench_depth; i++) {
+        struct bench_slot *slot = &t->slots[i];
+
+        slot->thread = t;
+        slot->page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP,
+                                      get_order(bench_bs));
+        if (!slot->page)
+            goto err;
+        /* Random data, so a compressing driver cannot make writes cheap. */
+        get_random_bytes(page_address(slot->page), bench_bs);
+        list_add_tail(&slot->list, &t->free);
+    }
+
+    t->task = kthread_create_on_node(bench_thread_fn, t, node,
+                                     "blkram_bench/%u", cpu);
+    if (IS_ERR(t->task))
+        goto err;
+    kthread_bind(t->task, cpu);
+
+    return t;
+
+err:
+    bench_free_thread(t);
+    return NULL;
+}
+
+/* Opening a block device by path went through four APIs:
+ *   6.9+     bdev_file_open_by_path(), closed with fput()
+ *   6.8      bdev_open_by_path() returning a struct bdev_handle
+ *   6.5-6.7  blkdev_get_by_path() with a blk_mode_t and holder ops
+ *   5.10-6.4 blkdev_get_by_path() with an fmode_t
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+static struct file *bench_bdev_file;
+
+static int bench_open(const char *path)
+{
+    bench_bdev_file = bdev_file_open_by_path(path, BLK_OPEN_READ |
+                                             BLK_OPEN_WRITE, NULL, NULL);
+    if (IS_ERR(bench_bdev_file))
+        return PTR_ERR(bench_bdev_file);
+    bench_bdev = file_bdev(bench_bdev_file);
+    return 0;
+}
+
+static void bench_close(void)
+{
+    fput(bench_bdev_file);
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+static struct bdev_handle *bench_bdev_handle;
+
+static int bench_open(const char *path)
+{
+    bench_bdev_handle = bdev_open_by_path(path, BLK_OPEN_READ |
+                                          BLK_OPEN_WRITE, NULL, NULL);
+    if (IS_ERR(bench_bdev_handle))
+        return PTR_ERR(bench_bdev_handle);
+    bench_bdev = bench_bdev_handle->bdev;
+    return 0;
+}
+
+static void bench_close(void)
+{
+    bdev_release(bench_bdev_handle);
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int bench_open(const char *path)
+{
+    bench_bdev = blkdev_get_by_path(path, BLK_OPEN_READ | BLK_OPEN_WRITE,
+                                    NULL, NULL);
+    return PTR_ERR_OR_ZERO(bench_bdev);
+}
+
+static void bench_close(void)
+{
+    blkdev_put(bench_bdev, NULL);
+}
+#else
+static int bench_open(const char *path)
+{
+    bench_bdev =
+        blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE, NULL);
+    return PTR_ERR_OR_ZERO(bench_bdev);
+}
+
+static void bench_close(void)
+{
+    blkdev_put(bench_bdev, FMODE_READ | FMODE_WRITE);
+}
+#endif
+
+/* The size of what was opened, which for a partition is less than the
+ * disk's get_capacity().
+ */
+static sector_t bench_nr_sectors(struct block_device *bdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+    return bdev_nr_sectors(bdev);
+#else
+    return i_size_read(bdev->bd_inode) >> SECTOR_SHIFT;
+#endif
+}
+
+/* Sum the per-CPU statistics into bench_result, using @hist, allocated
+ * zeroed before the run, to merge the histograms.
+ */
+static void bench_summarize(const char *path, u64 elapsed_ns, unsigned int nr,
+                            u64 *hist)
+{
+    struct bench_result *r = &bench_result;
+    u64 total = 0, seen = 0;
+    unsigned int b, p = 0;
+    int cpu;
+
+    memset(r, 0, sizeof(*r));
+
+    for_each_possible_cpu(cpu)
+    {
+        struct bench_stat *st = per_cpu_ptr(bench_stat, cpu);
+
+        r->ios[0] += st->ios[0];
+        r->ios[1] += st->ios[1];
+        r->bytes[0] += st->bytes[0];
+        r->bytes[1] += st->bytes[1];
+        r->errors += st->errors;
+        for (b = 0; b < BENCH_BUCKETS; b++)
+            hist[b] += st->hist[b];
+    }
+
+    for (b = 0; b < BENCH_BUCKETS; b++)
+        total += hist[b];
+    for (b = 0; b < BENCH_BUCKETS; b++) {
+        if (!hist[b])
+            continue;
+        seen += hist[b];
+        /* The first bucket reaching the percentile's share of samples. */
+        while (p < ARRAY_SIZE(bench_pcts) &&
+               seen * 100000 >= total * bench_pcts[p])
+            r->pct_ns[p++] = bench_bucket_ns(b);
+        r->max_ns = bench_bucket_ns(b);
+    }
+
+    strscpy(r->dev, path, sizeof(r->dev));
+    r->threads = nr;
+    r->depth = bench_depth;
+    r->bs = bench_bs;
+    r->read_pct = bench_read_pct;
+    r->random = bench_random;
+    r->elapsed_ns = elapsed_ns;
+    r->valid = true;
+}
+
+static int bench_run(void)
+{
+    struct bench_thread **t;
+    unsigned int nr, i = 0;
+    u64 *hist;
+    char *path;
+    u64 start;
+    int cpu, ret;
+
+    /* Parameters may change under a run, so it works on copies. */
+    kernel_param_lock(THIS_MODULE);
+    bench_bs = bs;
+    bench_depth = depth;
+    bench_read_pct = min(read_pct, 100U);
+    bench_random = rand_offsets;
+    path = kstrdup(bench_dev, GFP_KERNEL);
+    kernel_param_unlock(THIS_MODULE);
+    if (!path)
+        return -ENOMEM;
+
+    ret = -EINVAL;
+    if (!bench_depth || !runtime_ms || !bench_bs || bench_bs > SZ_1M)
+        goto out_free_path;
+
+    ret = bench_open(path);
+    if (ret)
+        goto out_free_path;
+
+    ret = -EINVAL;
+    if (bench_bs % bdev_logical_block_size(bench_bdev))
+        goto out_close;
+    bench_blocks = div_u64(bench_nr_sectors(bench_bdev) << SECTOR_SHIFT,
+                           bench_bs);
+    if (!bench_blocks)
+        goto out_close;
+
+    ret = -ENOMEM;
+    /* Allocated up front so that a finished run always gets its results. */
+    hist = kcalloc(BENCH_BUCKETS, sizeof(*hist), GFP_KERNEL);
+    if (!hist)
+        goto out_close;
+    bench_stat = alloc_percpu(struct bench_stat);
+    if (!bench_stat)
+        goto out_free_hist;
+
+    nr = threads ? min(threads, num_online_cpus()) : num_online_cpus();
+    t = kcalloc(nr, sizeof(*t), GFP_KERNEL);
+    if (!t)
+        goto out_free_stat;
+
+    for_each_online_cpu(cpu)
+    {
+        if (i == nr)
+            break;
+        t[i] = bench_alloc_thread(cpu, nr, i);
+        if (!t[i])
+            goto out_free_threads;
+        i++;
+    }
+    nr = i;
+
+    start = ktime_get_ns();
+    for (i = 0; i < nr; i++)
+        wake_up_process(t[i]->task);
+    msleep_interruptible(runtime_ms);
+    for (i = 0; i < nr; i++)
+        kthread_stop(t[i]->task);
+
+    bench_summarize(path, ktime_get_ns() - start, nr, hist);
+    ret = 0;
+
+out_free_threads:
+    for (i = 0; i < nr; i++) {
+        /* Threads that never ran still need stopping. */
+        if (ret && t[i])
+            kthread_stop(t[i]->task);
+        bench_free_thread(t[i]);
+    }
+    kfree(t);
+out_free_stat:
+    free_percpu(bench_stat);
+out_free_hist:
+    kfree(hist);
+out_close:
+    bench_close();
+out_free_path:
+    kfree(path);
+    return ret;
+}
+
+static ssize_t bench_run_write(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+    int ret;
+
+    if (mutex_lock_interruptible(&bench_lock))
+        return -EINTR;
+    ret = bench_run();
+    mutex_unlock(&bench_lock);
+
+    return ret ? ret : count;
+}
+
+static const struct file_operations bench_run_fops = {
+    .owner = THIS_MODULE,
+    .write = bench_run_write,
+};
+
+/* Rates over wall-clock time, so they include the final drain. */
+static u64 bench_rate(u64 n, u64 elapsed_ns)
+{
+    return elapsed_ns ? mul_u64_u64_div_u64(n, NSEC_PER_SEC, elapsed_ns) : 0;
+}
+
+static int bench_results_show(struct seq_file *m, void *v)
+{
+    struct bench_result *r = &bench_result;
+    unsigned int i;
+
+    mutex_lock(&bench_lock);
+    if (!r->valid) {
+        seq_puts(m, "no results yet\n");
+        goto out;
+    }
+
+    seq_printf(m,
+               "device %s\nthreads %u\ndepth %u\nbs %u\nread_pct %u\n"
+               "random %d\nelapsed_ms %llu\n",
+               r->dev, r->threads, r->depth, r->bs, r->read_pct, r->random,
+               div_u64(r->elapsed_ns, NSEC_PER_MSEC));
+    seq_printf(m, "read_iops %llu\nread_mib_s %llu\n",
+               bench_rate(r->ios[0], r->elapsed_ns),
+               bench_rate(r->bytes[0], r->elapsed_ns) >> 20);
+    seq_printf(m, "write_iops %llu\nwrite_mib_s %llu\n",
+               bench_rate(r->ios[1], r->elapsed_ns),
+               bench_rate(r->bytes[1], r->elapsed_ns) >> 20);
+    seq_printf(m, "errors %llu\n", r->errors);
+    for (i = 0; i < ARRAY_SIZE(bench_pcts); i++)
+        seq_printf(m, "lat_%s_ns %llu\n", bench_pct_names[i], r->pct_ns[i]);
+    seq_printf(m, "lat_max_ns %llu\n", r->max_ns);
+
+out:
+    mutex_unlock(&bench_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bench_results);
+
+static int __init bench_init(void)
+{
+    bench_debugfs = debugfs_create_dir("blkram_bench", NULL);
+    debugfs_create_file("run", 0200, bench_debugfs, NULL, &bench_run_fops);
+    debugfs_create_file("results", 0400, bench_debugfs, NULL,
+                        &bench_results_fops);
+
+    return 0;
+}
+
+/* Removing the files waits for a run still going on in bench_run_write(). */
+static void __exit bench_exit(void)
+{
+    debugfs_remove_recursive(bench_debugfs);
+}
+
+module_init(bench_init);
+module_exit(bench_exit);
+
+MODULE_DESCRIPTION("LKMPG in-kernel block I/O benchmark");
+MODULE_LICENSE("GPL");
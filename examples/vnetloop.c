@@ -2,69 +2,496 @@
 /*
  * vnetloop.c - Minimal virtual Ethernet device that loops transmitted packets
  * back into the receive path.
+ *
+ * By default every looped packet is handed to netif_rx(), which queues it on
+ * the per-CPU backlog and raises the receive softirq once per packet. With
+ * vnetloop_napi=1 the transmit path instead puts packets on a ring and
+ * schedules a NAPI instance, whose poll handler delivers them in batches of
+ * up to vnetloop_napi_weight, the way a real NIC's receive queue works.
+ *
+ * The device has vnetloop_queues TX/RX queue pairs, one per online CPU by
+ * default. XPS steers each CPU's transmissions to its own TX queue, and a
+ * packet sent on TX queue n comes back on RX queue n, so CPUs sending at
+ * the same time never share a queue lock, a ring or a counter.
+ *
+ * In NAPI mode the device also runs XDP programs in its poll handler, and
+ * accepts frames redirected to it by XDP programs on other devices.
  */
 
+#include <linux/bpf.h>
+#include <linux/cpumask.h>
 #include <linux/etherdevice.h>
+#include <linux/ethtool.h>
+#include <linux/filter.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/netdevice.h>
+#include <linux/ptr_ring.h>
+#include <linux/rtnetlink.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/u64_stats_sync.h>
+#include <linux/version.h>
+#include <net/xdp.h>
+
+static unsigned int vnetloop_queues;
+module_param(vnetloop_queues, uint, 0444);
+MODULE_PARM_DESC(vnetloop_queues,
+                 "Number of TX/RX queue pairs (0 = one per online CPU)");
+
+static bool vnetloop_napi;
+module_param(vnetloop_napi, bool, 0444);
+MODULE_PARM_DESC(vnetloop_napi, "Deliver looped packets through NAPI");
+
+static unsigned int vnetloop_napi_weight = NAPI_POLL_WEIGHT;
+module_param(vnetloop_napi_weight, uint, 0444);
+MODULE_PARM_DESC(vnetloop_napi_weight,
+                 "Most packets one NAPI poll delivers (1-64)");
+
+static unsigned int vnetloop_ring_size = 1024;
+module_param(vnetloop_ring_size, uint, 0444);
+MODULE_PARM_DESC(vnetloop_ring_size, "Packets the NAPI ring holds");
+
+/* XDP counters are indexed by the program's verdict, XDP_ABORTED to
+ * XDP_REDIRECT, followed by failed XDP_TX and XDP_REDIRECT attempts.
+ */
+#define VNETLOOP_XDP_ERRORS (XDP_REDIRECT + 1)
+#define VNETLOOP_XDP_STATS (VNETLOOP_XDP_ERRORS + 1)
+
+static const char
+    vnetloop_xdp_stat_names[VNETLOOP_XDP_STATS][ETH_GSTRING_LEN] = {
+    "xdp_aborted", "xdp_drop", "xdp_pass", "xdp_tx", "xdp_redirect",
+    "xdp_errors",
+};
+
+/* One TX/RX queue pair. Each group of counters has exactly one writer at a
+ * time, so a u64_stats_sync is all it needs: the transmit side is written
+ * under the TX queue's lock, and the receive side by whoever delivers, the
+ * transmit path with netif_rx() or the poll handler with NAPI. Nothing is
+ * shared between pairs, so CPUs on different queues never write to the
+ * same cache line.
+ */
+struct vnetloop_queue {
+    struct napi_struct napi;
+    struct ptr_ring ring;
+    struct xdp_rxq_info xdp_rxq;
+    u16 index;
+
+    u64_stats_t tx_packets;
+    u64_stats_t tx_bytes;
+    u64_stats_t tx_dropped; /* could not be turned into a received skb */
+    u64_stats_t rx_overruns; /* found the NAPI ring full */
+    struct u64_stats_sync tx_syncp;
+
+    u64_stats_t rx_packets;
+    u64_stats_t rx_bytes;
+    u64_stats_t rx_dropped; /* refused by the backlog or left on the ring */
+    u64_stats_t xdp_stats[VNETLOOP_XDP_STATS];
+    struct u64_stats_sync rx_syncp;
+} ____cacheline_aligned_in_smp;
 
 struct vnetloop_priv {
-    u64 tx_packets;
-    u64 tx_bytes;
-    u64 rx_packets;
-    u64 rx_bytes;
-    struct u64_stats_sync syncp;
+    struct vnetloop_queue *queues;
+    struct bpf_prog __rcu *xdp_prog;
 };
 
+/* The NAPI ring holds both skbs from the transmit path and xdp_frames,
+ * told apart by the lowest pointer bit as in veth. Every xdp_frame on it
+ * lives in an order-0 page of this driver's own, so whatever happens to
+ * it, it is freed the same way.
+ */
+#define VNETLOOP_XDP_FLAG 1UL
+
+static bool vnetloop_is_xdp_frame(void *ptr)
+{
+    return (unsigned long)ptr & VNETLOOP_XDP_FLAG;
+}
+
+static void *vnetloop_xdp_to_ptr(struct xdp_frame *frame)
+{
+    return (void *)((unsigned long)frame | VNETLOOP_XDP_FLAG);
+}
+
+static struct xdp_frame *vnetloop_ptr_to_xdp(void *ptr)
+{
+    return (void *)((unsigned long)ptr & ~VNETLOOP_XDP_FLAG);
+}
+
+static void vnetloop_free_ptr(void *ptr)
+{
+    if (vnetloop_is_xdp_frame(ptr))
+        xdp_return_frame(vnetloop_ptr_to_xdp(ptr));
+    else
+        kfree_skb(ptr);
+}
+
+/* An XDP buffer is a page with XDP_PACKET_HEADROOM in front of the frame
+ * for the program to grow headers into, and room behind it for the
+ * skb_shared_info that build_skb() puts there.
+ */
+#define VNETLOOP_XDP_MAX_LEN                                                   \
+    (PAGE_SIZE - XDP_PACKET_HEADROOM -                                         \
+     SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+/* Sets up @xdp over a new page for a @len byte frame, and returns where
+ * the frame goes.
+ */
+static void *vnetloop_xdp_alloc(struct vnetloop_queue *q, struct xdp_buff *xdp,
+                                unsigned int len)
+{
+    struct page *page;
+    void *hard_start;
+
+    if (len > VNETLOOP_XDP_MAX_LEN)
+        return NULL;
+    page = alloc_page(GFP_ATOMIC);
+    if (!page)
+        return NULL;
+    hard_start = page_address(page);
+
+/* The helpers arrived in 5.12; newer kernels also have fields such as
+ * flags that only they initialize.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    xdp_init_buff(xdp, PAGE_SIZE, &q->xdp_rxq);
+    xdp_prepare_buff(xdp, hard_start, XDP_PACKET_HEADROOM, len, true);
+#else
+    xdp->data_hard_start = hard_start;
+    xdp->data = hard_start + XDP_PACKET_HEADROOM;
+    xdp->data_end = xdp->data + len;
+    xdp->data_meta = xdp->data;
+    xdp->frame_sz = PAGE_SIZE;
+    xdp->rxq = &q->xdp_rxq;
+#endif
+
+    return xdp->data;
+}
+
+/* Puts @frame on @q's ring for its poll handler, or frees it. */
+static int vnetloop_xdp_produce(struct vnetloop_queue *q,
+                                struct xdp_frame *frame)
+{
+    if (ptr_ring_produce(&q->ring, vnetloop_xdp_to_ptr(frame))) {
+        xdp_return_frame(frame);
+        return -ENOSPC;
+    }
+    napi_schedule(&q->napi);
+
+    return 0;
+}
+
+/* Returns nonzero if the ring is full and @skb was dropped. A full ring
+ * also stops the queue until the poll handler has made room, which is the
+ * usual NIC flow control: the qdisc holds packets instead of the driver
+ * dropping them.
+ */
+static int vnetloop_enqueue(struct net_device *dev, struct vnetloop_queue *q,
+                            struct sk_buff *skb)
+{
+    if (ptr_ring_produce(&q->ring, skb)) {
+        kfree_skb(skb);
+        return -ENOSPC;
+    }
+    if (ptr_ring_full(&q->ring))
+        netif_stop_subqueue(dev, q->index);
+    /* Scheduled after stopping the queue, so a poll that missed the stop
+     * always runs again and wakes it.
+     */
+    napi_schedule(&q->napi);
+
+    return 0;
+}
+
+/* What one poll did, added to the queue's counters at the end. */
+struct vnetloop_batch {
+    u64 packets;
+    u64 bytes;
+    u64 dropped;
+    u64 xdp[VNETLOOP_XDP_STATS];
+    bool redirect;
+};
+
+/* An XDP program reads the bytes, so a looped skb has to be made into a
+ * complete frame with the MAC header, in a page laid out for XDP.
+ */
+static int vnetloop_skb_to_xdp(struct vnetloop_queue *q, struct sk_buff *skb,
+                               struct xdp_buff *xdp)
+{
+    void *data;
+
+    skb_push(skb, ETH_HLEN);
+    data = vnetloop_xdp_alloc(q, xdp, skb->len);
+    if (!data) {
+        kfree_skb(skb);
+        return -ENOMEM;
+    }
+    skb_copy_bits(skb, 0, data, skb->len);
+    consume_skb(skb);
+
+    return 0;
+}
+
+static struct sk_buff *vnetloop_xdp_build_skb(struct vnetloop_queue *q,
+                                              struct xdp_buff *xdp)
+{
+    unsigned int metasize = xdp->data - xdp->data_meta;
+    struct sk_buff *skb;
+
+    skb = build_skb(xdp->data_hard_start, xdp->frame_sz);
+    if (!skb) {
+        xdp_return_buff(xdp);
+        return NULL;
+    }
+    skb_reserve(skb, xdp->data - xdp->data_hard_start);
+    skb_put(skb, xdp->data_end - xdp->data);
+    if (metasize)
+        skb_metadata_set(skb, metasize);
+    skb_record_rx_queue(skb, q->index);
+    /* ip_summed stays CHECKSUM_NONE: the program may have rewritten
+     * anything, so the stack checks for itself.
+     */
+    skb->protocol = eth_type_trans(skb, q->napi.dev);
+
+    return skb;
+}
+
+/* Runs @prog, if there is one, on a ring entry, and returns the skb to
+ * deliver if the verdict is XDP_PASS.
+ */
+static struct sk_buff *vnetloop_xdp_rcv(struct vnetloop_queue *q,
+                                        struct bpf_prog *prog, void *ptr,
+                                        struct vnetloop_batch *batch)
+{
+    struct net_device *dev = q->napi.dev;
+    struct xdp_frame *frame;
+    struct sk_buff *skb;
+    struct xdp_buff xdp;
+    u32 act = XDP_PASS;
+
+    if (vnetloop_is_xdp_frame(ptr)) {
+        xdp_convert_frame_to_buff(vnetloop_ptr_to_xdp(ptr), &xdp);
+        xdp.rxq = &q->xdp_rxq;
+    } else if (vnetloop_skb_to_xdp(q, ptr, &xdp)) {
+        batch->dropped++;
+        return NULL;
+    }
+
+    if (prog)
+        act = bpf_prog_run_xdp(prog, &xdp);
+
+    switch (act) {
+    case XDP_PASS:
+        break;
+    case XDP_TX:
+        /* Transmitting on a loopback device means receiving again. */
+        frame = xdp_convert_buff_to_frame(&xdp);
+        if (!frame) {
+            xdp_return_buff(&xdp);
+            batch->xdp[VNETLOOP_XDP_ERRORS]++;
+        } else if (vnetloop_xdp_produce(q, frame)) {
+            batch->xdp[VNETLOOP_XDP_ERRORS]++;
+        }
+        batch->xdp[act]++;
+        return NULL;
+    case XDP_REDIRECT:
+        if (xdp_do_redirect(dev, &xdp, prog)) {
+            xdp_return_buff(&xdp);
+            batch->xdp[VNETLOOP_XDP_ERRORS]++;
+        } else {
+            batch->redirect = true;
+        }
+        batch->xdp[act]++;
+        return NULL;
+    default:
+/* The device became an argument in 5.17. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+        bpf_warn_invalid_xdp_action(dev, prog, act);
+#else
+        bpf_warn_invalid_xdp_action(act);
+#endif
+        act = XDP_ABORTED;
+        fallthrough;
+    case XDP_ABORTED:
+    case XDP_DROP:
+        xdp_return_buff(&xdp);
+        batch->xdp[act]++;
+        return NULL;
+    }
+
+    if (prog)
+        batch->xdp[XDP_PASS]++;
+    skb = vnetloop_xdp_build_skb(q, &xdp);
+    if (!skb)
+        batch->dropped++;
+    return skb;
+}
+
+static int vnetloop_poll(struct napi_struct *napi, int budget)
+{
+    struct vnetloop_queue *q = container_of(napi, struct vnetloop_queue, napi);
+    struct vnetloop_priv *priv = netdev_priv(napi->dev);
+    struct netdev_queue *txq = netdev_get_tx_queue(napi->dev, q->index);
+    struct vnetloop_batch batch = {};
+    struct bpf_prog *prog;
+    struct sk_buff *skb;
+    unsigned int i;
+    void *ptr;
+    int done = 0;
+
+    rcu_read_lock();
+    prog = rcu_dereference(priv->xdp_prog);
+    while (done < budget && (ptr = __ptr_ring_consume(&q->ring))) {
+        done++;
+        /* Frames go through the XDP path even once the program is gone. */
+        if (prog || vnetloop_is_xdp_frame(ptr)) {
+            skb = vnetloop_xdp_rcv(q, prog, ptr, &batch);
+            if (!skb)
+                continue;
+        } else {
+            skb = ptr;
+        }
+        batch.packets++;
+        batch.bytes += skb->len;
+        napi_gro_receive(napi, skb);
+    }
+    /* Redirected frames are only queued until the flush. */
+    if (batch.redirect)
+        xdp_do_flush();
+    rcu_read_unlock();
+
+    /* One update for the whole batch. */
+    u64_stats_update_begin(&q->rx_syncp);
+    u64_stats_add(&q->rx_packets, batch.packets);
+    u64_stats_add(&q->rx_bytes, batch.bytes);
+    u64_stats_add(&q->rx_dropped, batch.dropped);
+    for (i = 0; i < VNETLOOP_XDP_STATS; i++)
+        u64_stats_add(&q->xdp_stats[i], batch.xdp[i]);
+    u64_stats_update_end(&q->rx_syncp);
+
+    if (netif_tx_queue_stopped(txq) && !ptr_ring_full(&q->ring))
+        netif_tx_wake_queue(txq);
+    /* A packet queued after the ring looked empty has called
+     * napi_schedule() in the meantime, and napi_complete_done() then
+     * reschedules the poll instead of finishing.
+     */
+    if (done < budget)
+        napi_complete_done(napi, done);
+
+    return done;
+}
+
+/* The transmitted skb itself becomes the received one, as on the loopback
+ * device, so no payload is copied. It first has to stop being a transmit
+ * skb: orphaning it runs the socket destructor, returning its memory to the
+ * sender the way a NIC's TX completion would, and scrubbing drops the
+ * route, conntrack and other state that belongs to the sending side.
+ * Fragments that still point at user pages (MSG_ZEROCOPY) are copied, since
+ * the receive path may hold on to them indefinitely.
+ */
+static int vnetloop_loop_skb(struct sk_buff *skb, struct net_device *dev,
+                             struct vnetloop_queue *q)
+{
+    struct vnetloop_priv *priv = netdev_priv(dev);
+
+    if (skb_orphan_frags_rx(skb, GFP_ATOMIC))
+        return -ENOMEM;
+    /* An XDP program reads the checksum fields, so they must be filled
+     * in rather than left to an offload that never happens here.
+     */
+    if (rcu_access_pointer(priv->xdp_prog) &&
+        skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb))
+        return -EINVAL;
+
+    skb_orphan(skb);
+    skb_scrub_packet(skb, false);
+    skb_record_rx_queue(skb, q->index);
+    skb->dev = dev;
+    skb->ip_summed = CHECKSUM_UNNECESSARY;
+    skb->protocol = eth_type_trans(skb, dev);
+
+    return 0;
+}
+
 static netdev_tx_t vnetloop_xmit(struct sk_buff *skb, struct net_device *dev)
 {
     struct vnetloop_priv *priv = netdev_priv(dev);
-    struct sk_buff *rx_skb;
+    struct vnetloop_queue *q = &priv->queues[skb_get_queue_mapping(skb)];
     unsigned int len = skb->len;
+    unsigned int rx_len;
+    bool overrun = false;
+
+    if (vnetloop_loop_skb(skb, dev, q)) {
+        kfree_skb(skb);
+        u64_stats_update_begin(&q->tx_syncp);
+        u64_stats_inc(&q->tx_dropped);
+        u64_stats_update_end(&q->tx_syncp);
+        return NETDEV_TX_OK;
+    }
+    /* Once handed on, the skb may be freed on another CPU. */
+    rx_len = skb->len;
 
-    rx_skb = skb_copy(skb, GFP_ATOMIC);
-    if (rx_skb) {
-        rx_skb->dev = dev;
-        skb_reset_mac_header(rx_skb);
-        rx_skb->ip_summed = CHECKSUM_UNNECESSARY;
-        rx_skb->protocol = eth_type_trans(rx_skb, dev);
-
-        u64_stats_update_begin(&priv->syncp);
-        priv->tx_packets++;
-        priv->tx_bytes += len;
-        priv->rx_packets++;
-        priv->rx_bytes += rx_skb->len;
-        u64_stats_update_end(&priv->syncp);
-
-        netif_rx(rx_skb);
+    if (!vnetloop_napi) {
+        bool dropped = netif_rx(skb) == NET_RX_DROP;
+
+        u64_stats_update_begin(&q->rx_syncp);
+        if (dropped) {
+            u64_stats_inc(&q->rx_dropped);
+        } else {
+            u64_stats_inc(&q->rx_packets);
+            u64_stats_add(&q->rx_bytes, rx_len);
+        }
+        u64_stats_update_end(&q->rx_syncp);
     } else {
-        u64_stats_update_begin(&priv->syncp);
-        priv->tx_packets++;
-        priv->tx_bytes += len;
-        u64_stats_update_end(&priv->syncp);
+        /* The poll handler counts what it delivers. */
+        overrun = vnetloop_enqueue(dev, q, skb);
     }
 
-    dev_kfree_skb(skb);
+    u64_stats_update_begin(&q->tx_syncp);
+    u64_stats_inc(&q->tx_packets);
+    u64_stats_add(&q->tx_bytes, len);
+    if (overrun)
+        u64_stats_inc(&q->rx_overruns);
+    u64_stats_update_end(&q->tx_syncp);
 
     return NETDEV_TX_OK;
 }
 
 static int vnetloop_open(struct net_device *dev)
 {
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    unsigned int i;
+
+    for (i = 0; vnetloop_napi && i < dev->real_num_tx_queues; i++)
+        napi_enable(&priv->queues[i].napi);
     netif_carrier_on(dev);
-    netif_start_queue(dev);
+    netif_tx_start_all_queues(dev);
 
     return 0;
 }
 
 static int vnetloop_stop(struct net_device *dev)
 {
-    netif_stop_queue(dev);
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    unsigned int i;
+    void *ptr;
+
+    netif_tx_stop_all_queues(dev);
     netif_carrier_off(dev);
+    for (i = 0; vnetloop_napi && i < dev->real_num_tx_queues; i++) {
+        struct vnetloop_queue *q = &priv->queues[i];
+
+        napi_disable(&q->napi);
+        /* Packets still on the ring were never delivered. With the poll
+         * handler disabled, this is the only writer of the RX counters.
+         */
+        while ((ptr = ptr_ring_consume(&q->ring))) {
+            vnetloop_free_ptr(ptr);
+            u64_stats_update_begin(&q->rx_syncp);
+            u64_stats_inc(&q->rx_dropped);
+            u64_stats_update_end(&q->rx_syncp);
+        }
+    }
 
     return 0;
 }
@@ -73,15 +500,118 @@ static void vnetloop_get_stats64(struct net_device *dev,
                                  struct rtnl_link_stats64 *stats)
 {
     struct vnetloop_priv *priv = netdev_priv(dev);
-    unsigned int start;
+    u64 packets, bytes, dropped, overruns;
+    unsigned int start, i;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        struct vnetloop_queue *q = &priv->queues[i];
+
+        do {
+            start = u64_stats_fetch_begin(&q->tx_syncp);
+            packets = u64_stats_read(&q->tx_packets);
+            bytes = u64_stats_read(&q->tx_bytes);
+            dropped = u64_stats_read(&q->tx_dropped);
+            overruns = u64_stats_read(&q->rx_overruns);
+        } while (u64_stats_fetch_retry(&q->tx_syncp, start));
+
+        stats->tx_packets += packets;
+        stats->tx_bytes += bytes;
+        stats->tx_dropped += dropped;
+        stats->rx_over_errors += overruns;
+        stats->rx_dropped += overruns;
+
+        do {
+            start = u64_stats_fetch_begin(&q->rx_syncp);
+            packets = u64_stats_read(&q->rx_packets);
+            bytes = u64_stats_read(&q->rx_bytes);
+            dropped = u64_stats_read(&q->rx_dropped);
+        } while (u64_stats_fetch_retry(&q->rx_syncp, start));
+
+        stats->rx_packets += packets;
+        stats->rx_bytes += bytes;
+        stats->rx_dropped += dropped;
+    }
+}
+
+/* Programs are attached and detached under RTNL; a poll handler still
+ * running the old one keeps it alive until the RCU grace period that
+ * bpf_prog_put() waits for before freeing it.
+ */
+static int vnetloop_xdp_set(struct net_device *dev, struct bpf_prog *prog,
+                            struct netlink_ext_ack *extack)
+{
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    struct bpf_prog *old;
+
+    if (!vnetloop_napi) {
+        NL_SET_ERR_MSG_MOD(extack, "XDP needs vnetloop_napi=1");
+        return -EOPNOTSUPP;
+    }
+
+    old = rtnl_dereference(priv->xdp_prog);
+    rcu_assign_pointer(priv->xdp_prog, prog);
+    if (old)
+        bpf_prog_put(old);
+
+    return 0;
+}
+
+static int vnetloop_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+    switch (bpf->command) {
+    case XDP_SETUP_PROG:
+        return vnetloop_xdp_set(dev, bpf->prog, bpf->extack);
+    default:
+        return -EINVAL;
+    }
+}
+
+/* Frames redirected here by another device's XDP program. They are copied
+ * into pages of this device's own, because the ring may only hold frames
+ * that are freed like its own, whatever memory model the sender used.
+ * Each frame is handed back to its sender as soon as it has been copied.
+ */
+static int vnetloop_xdp_xmit(struct net_device *dev, int n,
+                             struct xdp_frame **frames, u32 flags)
+{
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    struct vnetloop_queue *q;
+    struct xdp_frame *copy;
+    struct xdp_buff xdp;
+    void *data;
+    int i, sent;
+
+    if (flags & ~XDP_XMIT_FLAGS_MASK)
+        return -EINVAL;
+    if (!vnetloop_napi || !netif_running(dev))
+        return -ENETDOWN;
+
+    q = &priv->queues[smp_processor_id() % dev->real_num_rx_queues];
+    for (i = 0; i < n; i++) {
+        data = vnetloop_xdp_alloc(q, &xdp, frames[i]->len);
+        if (!data)
+            break;
+        memcpy(data, frames[i]->data, frames[i]->len);
+        copy = xdp_convert_buff_to_frame(&xdp);
+        if (!copy) {
+            xdp_return_buff(&xdp);
+            break;
+        }
+        if (vnetloop_xdp_produce(q, copy))
+            break;
+        xdp_return_frame(frames[i]);
+    }
 
-    do {
-        start = u64_stats_fetch_begin(&priv->syncp);
-        stats->tx_packets = priv->tx_packets;
-        stats->tx_bytes = priv->tx_bytes;
-        stats->rx_packets = priv->rx_packets;
-        stats->rx_bytes = priv->rx_bytes;
-    } while (u64_stats_fetch_retry(&priv->syncp, start));
+/* Before 5.13 the driver freed the frames it could not take itself; now
+ * the caller frees everything past the count returned.
+ */
+    sent = i;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
+    while (i < n)
+        xdp_return_frame(frames[i++]);
+#endif
+
+    return sent;
 }
 
 static const struct net_device_ops vnetloop_netdev_ops = {
@@ -89,43 +619,239 @@ static const struct net_device_ops vnetloop_netdev_ops = {
     .ndo_stop = vnetloop_stop,
     .ndo_start_xmit = vnetloop_xmit,
     .ndo_get_stats64 = vnetloop_get_stats64,
+    .ndo_bpf = vnetloop_bpf,
+    .ndo_xdp_xmit = vnetloop_xdp_xmit,
+};
+
+/* The per-verdict XDP counters, summed over all queues, for ethtool -S. */
+static int vnetloop_get_sset_count(struct net_device *dev, int sset)
+{
+    return sset == ETH_SS_STATS ? VNETLOOP_XDP_STATS : -EOPNOTSUPP;
+}
+
+static void vnetloop_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    if (sset == ETH_SS_STATS)
+        memcpy(data, vnetloop_xdp_stat_names,
+               sizeof(vnetloop_xdp_stat_names));
+}
+
+static void vnetloop_get_ethtool_stats(struct net_device *dev,
+                                       struct ethtool_stats *stats, u64 *data)
+{
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    u64 xdp[VNETLOOP_XDP_STATS];
+    unsigned int start, i, j;
+
+    memset(data, 0, VNETLOOP_XDP_STATS * sizeof(*data));
+    for (i = 0; i < dev->real_num_rx_queues; i++) {
+        struct vnetloop_queue *q = &priv->queues[i];
+
+        do {
+            start = u64_stats_fetch_begin(&q->rx_syncp);
+            for (j = 0; j < VNETLOOP_XDP_STATS; j++)
+                xdp[j] = u64_stats_read(&q->xdp_stats[j]);
+        } while (u64_stats_fetch_retry(&q->rx_syncp, start));
+
+        for (j = 0; j < VNETLOOP_XDP_STATS; j++)
+            data[j] += xdp[j];
+    }
+}
+
+static const struct ethtool_ops vnetloop_ethtool_ops = {
+    .get_sset_count = vnetloop_get_sset_count,
+    .get_strings = vnetloop_get_strings,
+    .get_ethtool_stats = vnetloop_get_ethtool_stats,
 };
 
 static void vnetloop_setup(struct net_device *dev)
 {
     dev->netdev_ops = &vnetloop_netdev_ops;
+    dev->ethtool_ops = &vnetloop_ethtool_ops;
     dev->flags |= IFF_NOARP;
-    dev->features |= NETIF_F_HW_CSUM;
+    /* Nothing is copied or DMA-mapped, so scattered and highmem data are
+     * as good as linear data.
+     */
+    dev->features |= NETIF_F_HW_CSUM | NETIF_F_SG | NETIF_F_HIGHDMA;
+    /* The skb is handed up the stack, so it must not be shared with a
+     * sender such as pktgen that transmits the same skb repeatedly.
+     */
+    dev->priv_flags &= ~IFF_TX_SKB_SHARING;
     eth_hw_addr_random(dev);
+/* Since 6.3 a device has to declare what XDP it supports, and a redirect
+ * to one that does not list NDO_XMIT fails.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    if (vnetloop_napi)
+        dev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+                            NETDEV_XDP_ACT_NDO_XMIT;
+#endif
+}
+
+/* The NAPI-mode parts of a queue pair: the ring, the NAPI instance, and
+ * the XDP receive queue information that frames built here point to.
+ */
+static int vnetloop_init_napi(struct net_device *dev, struct vnetloop_queue *q,
+                              unsigned int weight)
+{
+    int ret;
+
+    ret = ptr_ring_init(&q->ring, max(vnetloop_ring_size, 2U), GFP_KERNEL);
+    if (ret)
+        return ret;
+
+/* The weight got its own helper in 5.19, and netif_napi_add() lost the
+ * argument in 6.1.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    netif_napi_add_weight(dev, &q->napi, vnetloop_poll, weight);
+#else
+    netif_napi_add(dev, &q->napi, vnetloop_poll, weight);
+#endif
+
+/* The NAPI ID argument was added in 5.11. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    ret = xdp_rxq_info_reg(&q->xdp_rxq, dev, q->index, q->napi.napi_id);
+#else
+    ret = xdp_rxq_info_reg(&q->xdp_rxq, dev, q->index);
+#endif
+    if (ret)
+        goto err_del_napi;
+    ret = xdp_rxq_info_reg_mem_model(&q->xdp_rxq, MEM_TYPE_PAGE_ORDER0, NULL);
+    if (ret)
+        goto err_unreg_rxq;
+
+    return 0;
+
+err_unreg_rxq:
+    xdp_rxq_info_unreg(&q->xdp_rxq);
+err_del_napi:
+    netif_napi_del(&q->napi);
+    ptr_ring_cleanup(&q->ring, NULL);
+    return ret;
+}
+
+static void vnetloop_free_napi(struct vnetloop_queue *q)
+{
+    ptr_ring_cleanup(&q->ring, vnetloop_free_ptr);
+    netif_napi_del(&q->napi);
+    xdp_rxq_info_unreg(&q->xdp_rxq);
+}
+
+static void vnetloop_free_queues(struct net_device *dev)
+{
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    unsigned int i;
+
+    for (i = 0; vnetloop_napi && i < dev->real_num_tx_queues; i++)
+        vnetloop_free_napi(&priv->queues[i]);
+    kfree(priv->queues);
+}
+
+static int vnetloop_init_queues(struct net_device *dev)
+{
+    struct vnetloop_priv *priv = netdev_priv(dev);
+    unsigned int weight =
+        clamp_t(unsigned int, vnetloop_napi_weight, 1, NAPI_POLL_WEIGHT);
+    unsigned int i;
+    int ret;
+
+    priv->queues =
+        kcalloc(dev->real_num_tx_queues, sizeof(*priv->queues), GFP_KERNEL);
+    if (!priv->queues)
+        return -ENOMEM;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        struct vnetloop_queue *q = &priv->queues[i];
+
+        q->index = i;
+        u64_stats_init(&q->tx_syncp);
+        u64_stats_init(&q->rx_syncp);
+        if (!vnetloop_napi)
+            continue;
+
+        ret = vnetloop_init_napi(dev, q, weight);
+        if (ret)
+            goto err;
+    }
+
+    return 0;
+
+err:
+    while (i--)
+        vnetloop_free_napi(&priv->queues[i]);
+    kfree(priv->queues);
+    return ret;
+}
+
+/* Deal the online CPUs out over the TX queues round-robin, so with one
+ * queue per CPU each CPU transmits on a queue of its own. CPUs that come
+ * online later fall back to the stack's hash-based queue selection.
+ */
+static void vnetloop_set_xps(struct net_device *dev)
+{
+    unsigned int nr = dev->real_num_tx_queues;
+    unsigned int i, n;
+    cpumask_var_t mask;
+    int cpu;
+
+    if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+        return;
+
+    for (i = 0; i < nr; i++) {
+        cpumask_clear(mask);
+        n = 0;
+        for_each_online_cpu(cpu)
+        {
+            if (n++ % nr == i)
+                cpumask_set_cpu(cpu, mask);
+        }
+        /* Without a map the queue is still used, just picked by hash. */
+        netif_set_xps_queue(dev, mask, i);
+    }
+
+    free_cpumask_var(mask);
 }
 
 static struct net_device *vnetloop_dev;
 
 static int __init vnetloop_init(void)
 {
+    unsigned int nr = vnetloop_queues ?: num_online_cpus();
     int ret;
 
-    vnetloop_dev = alloc_etherdev(sizeof(struct vnetloop_priv));
+    vnetloop_dev = alloc_etherdev_mqs(sizeof(struct vnetloop_priv), nr, nr);
     if (!vnetloop_dev)
         return -ENOMEM;
 
     strscpy(vnetloop_dev->name, "vnetloop%d", IFNAMSIZ);
     vnetloop_setup(vnetloop_dev);
 
+    ret = vnetloop_init_queues(vnetloop_dev);
+    if (ret)
+        goto err_free_netdev;
+
     ret = register_netdev(vnetloop_dev);
-    if (ret) {
-        free_netdev(vnetloop_dev);
-        return ret;
-    }
+    if (ret)
+        goto err_free_queues;
 
-    pr_info("vnetloop: registered %s\n", vnetloop_dev->name);
+    vnetloop_set_xps(vnetloop_dev);
+    pr_info("vnetloop: registered %s with %u queues\n", vnetloop_dev->name,
+            nr);
 
     return 0;
+
+err_free_queues:
+    vnetloop_free_queues(vnetloop_dev);
+err_free_netdev:
+    free_netdev(vnetloop_dev);
+    return ret;
 }
 
 static void __exit vnetloop_exit(void)
 {
     unregister_netdev(vnetloop_dev);
+    vnetloop_free_queues(vnetloop_dev);
     free_netdev(vnetloop_dev);
 }
 